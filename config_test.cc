@@ -0,0 +1,45 @@
+#include "takina.h"
+
+#include <stdio.h>
+
+// Usage: ./config_test <config-file> [options]
+// e.g.
+// ./config_test config_test.conf
+// ./config_test config_test.conf -p 80 --peers c   # argv overrides the file
+// printf '[Plugin foo]\nport = 1\n' > bad.conf && ./config_test bad.conf
+// bad.conf:2: Option: port does not belong to section: Plugin foo
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <config-file> [options]\n", argv[0]);
+    return 1;
+  }
+
+  int                      port = 0;
+  bool                     verbose;
+  std::vector<std::string> peers;
+  int                      foo_level = 0;
+  auto port_handle = takina::AddOption({"p", "port", "Port number", "PORT"}, &port);
+  takina::AddOption({"v", "verbose", "Verbose output"}, &verbose);
+  takina::AddOption({"", "peers", "Peer addresses"}, &peers);
+  takina::AddSection("Plugin foo");
+  takina::AddOption({"", "foo-level", "Level of foo"}, &foo_level);
+  // The port in the file satisfies it
+  takina::AddRequired("port");
+
+  std::string         errmsg;
+  takina::ParseResult result;
+  if (!takina::ParseConfigFile(argv[1], &errmsg) ||
+      !takina::Parse(argv + 2, argv + argc, &errmsg, &result))
+  {
+    fprintf(stderr, "%s\n", errmsg.c_str());
+    return 0;
+  }
+
+  printf("port = %d(%s)\n", port, result.ArgvIndex(port_handle) < 0 ? "file" : "argv");
+  printf("verbose = %d, foo-level = %d\n", verbose, foo_level);
+  for (auto const &peer : peers) {
+    printf("peer: %s\n", peer.c_str());
+  }
+  takina::Teardown();
+}
@@ -0,0 +1,40 @@
+#include "takina.h"
+
+#include <stdio.h>
+
+// e.g.
+// ./constraint_test -p 80 --peer a --peer b
+// ./constraint_test -p 80 --verbose --quiet   # mutually exclusive
+// ./constraint_test -p 80 --key k             # key requires cert
+// ./constraint_test --peer a                  # port is required
+int main(int argc, char **argv)
+{
+  int                      port = 0;
+  bool                     verbose;
+  bool                     quiet;
+  std::string              key;
+  std::string              cert;
+  std::vector<std::string> peers;
+  takina::AddOption({"p", "port", "Port number", "PORT"}, &port);
+  takina::AddOption({"v", "verbose", "Verbose output"}, &verbose);
+  takina::AddOption({"q", "quiet", "No output"}, &quiet);
+  takina::AddOption({"", "key", "Private key file"}, &key);
+  takina::AddOption({"", "cert", "Certificate file"}, &cert);
+  auto peer_handle = takina::AddOption({"", "peer", "Peer address"}, &peers);
+
+  takina::AddRequired("port");
+  takina::AddExclusive({"verbose", "quiet"});
+  takina::AddDependency("key", "cert");
+  takina::SetOccurrence("peer", 0, 2);
+
+  std::string         errmsg;
+  takina::ParseResult result;
+  if (!takina::Parse(argc, argv, &errmsg, &result)) {
+    fprintf(stderr, "%s\n", errmsg.c_str());
+    return 0;
+  }
+
+  printf("port = %d, verbose = %d, quiet = %d\n", port, verbose, quiet);
+  printf("key = %s, cert = %s\n", key.c_str(), cert.c_str());
+  printf("peer occurrences = %u\n", result.Occurrences(peer_handle));
+}
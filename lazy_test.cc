@@ -0,0 +1,42 @@
+#include "takina.h"
+
+#include <stdio.h>
+
+// e.g.
+// ./lazy_test --ids 1 2 3 --ratio 0.5
+// ./lazy_test --ids 1 x 3        # reported by ValidateAll()
+int main(int argc, char **argv)
+{
+  takina::LazyValue<std::vector<int>> ids;
+  takina::LazyValue<double>           ratio;
+  takina::AddOption({"", "ids", "Ids"}, &ids);
+  takina::AddOption({"r", "ratio", "Ratio"}, &ratio);
+
+  std::string errmsg;
+  if (!takina::Parse(argc, argv, &errmsg)) {
+    fprintf(stderr, "%s\n", errmsg.c_str());
+    return 0;
+  }
+  printf("ids recorded: %zu, converted: %d\n", ids.Arguments().size(), ids.IsConverted());
+
+  if (!takina::ValidateAll(&errmsg)) {
+    fprintf(stderr, "%s\n", errmsg.c_str());
+    return 0;
+  }
+
+  printf("ids:");
+  for (auto id : *ids.Get()) {
+    printf(" %d", id);
+  }
+  printf(", ratio: %g\n", *ratio.Get());
+
+  // Parse again, the arguments are replaced instead of appended
+  char  arg0[] = "--ids";
+  char  arg1[] = "7";
+  char *args[] = {arg0, arg1};
+  if (!takina::Parse(args, args + 2, &errmsg)) {
+    fprintf(stderr, "%s\n", errmsg.c_str());
+    return 0;
+  }
+  printf("ids after parsing again: %zu, ratio: %g\n", ids.Get()->size(), *ratio.Get());
+}
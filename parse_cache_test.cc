@@ -0,0 +1,59 @@
+#include "takina.h"
+
+#include <stdio.h>
+
+// Parse the command lines in order and print the cache statistics,
+// e.g. ./parse_cache_test
+static int                      port;
+static std::vector<std::string> peers;
+
+static void ParseLine(char const *name, std::vector<std::string> args)
+{
+  std::vector<char *> argv;
+  for (auto &arg : args) {
+    argv.push_back(&arg[0]);
+  }
+
+  std::string errmsg;
+  const bool  success = takina::Parse(argv.data(), argv.data() + argv.size(), &errmsg);
+  const auto  stats   = takina::GetParseCacheStats();
+  printf(
+      "%-12s success = %d, port = %d, peers = %zu, hits = %llu, misses = %llu\n",
+      name,
+      success,
+      port,
+      peers.size(),
+      (unsigned long long)stats.hits,
+      (unsigned long long)stats.misses
+  );
+  peers.clear();
+}
+
+int main()
+{
+  takina::AddOption({"p", "port", "Port number", "PORT"}, &port);
+  takina::AddOption({"", "peers", "Peer addresses"}, &peers);
+  takina::EnableParseCache(2);
+
+  ParseLine("miss", {"-p", "80", "--peers", "a", "b"});
+  ParseLine("hit", {"-p", "80", "--peers", "a", "b"});
+  ParseLine("miss", {"-p", "81"});
+  ParseLine("miss", {"-p", "82"});
+  // The capacity is 2, so the first one is evicted
+  ParseLine("evicted", {"-p", "80", "--peers", "a", "b"});
+  ParseLine("hit", {"-p", "82"});
+
+  // The options are changed, the cached results are stale
+  takina::UpdateOptions([]() {
+    static bool verbose;
+    takina::AddOption({"v", "verbose", "Verbose output"}, &verbose);
+  });
+  ParseLine("invalidated", {"-p", "82"});
+  ParseLine("hit", {"-p", "82"});
+
+  // The registry is rebuilt, the ids may be different
+  takina::Teardown();
+  takina::AddOption({"", "peers", "Peer addresses"}, &peers);
+  takina::AddOption({"p", "port", "Port number", "PORT"}, &port);
+  ParseLine("teardown", {"-p", "82"});
+}
@@ -0,0 +1,37 @@
+#include "takina.h"
+
+#include <stdio.h>
+
+// e.g.
+// ./positional_test a.txt b.txt 1 2 3
+// ./positional_test -v a.txt b.txt 1 -p 80 2   # options can be between them
+// ./positional_test a.txt                      # <dst> is required
+// ./positional_test a.txt b.txt x              # <ids...> are integers
+int main(int argc, char **argv)
+{
+  int                  port = 0;
+  bool                 verbose;
+  std::string          src;
+  std::string          dst;
+  std::vector<int64_t> ids;
+  takina::AddOption({"p", "port", "Port number", "PORT"}, &port);
+  takina::AddOption({"v", "verbose", "Verbose output"}, &verbose);
+  takina::AddPositional({"src", "Source file"}, &src);
+  takina::AddPositional({"dst", "Destination file"}, &dst);
+  takina::AddPositional({"ids", "Ids"}, &ids);
+
+  std::string         errmsg;
+  takina::ParseResult result;
+  if (!takina::Parse(argc, argv, &errmsg, &result)) {
+    fprintf(stderr, "%s\n", errmsg.c_str());
+    return 0;
+  }
+
+  printf("port = %d, verbose = %d\n", port, verbose);
+  printf("src = %s, dst = %s\n", src.c_str(), dst.c_str());
+  printf("ids(%u positional arguments):", result.PositionalCount());
+  for (auto id : ids) {
+    printf(" %lld", (long long)id);
+  }
+  printf("\n");
+}
@@ -0,0 +1,59 @@
+#include "takina.h"
+
+#include <stdio.h>
+
+// Usage: ./shell_test < commands
+// e.g.
+// echo 'set -p 8080 --name "hello world" # comment' | ./shell_test
+// printf 'add a --ids 1 2\nadd b c --ids 3\n' | ./shell_test
+int main()
+{
+  int              port = 0;
+  std::string      name;
+  std::vector<int> ids;
+  auto             port_handle = takina::AddOption({"p", "port", "Port number", "PORT"}, &port);
+  takina::AddOption({"n", "name", "Name"}, &name);
+  auto ids_handle = takina::AddOption({"", "ids", "Ids"}, &ids);
+  takina::EnableIndependentNonOptionArgument(true);
+
+  typedef std::vector<char const *> ArgList;
+
+  takina::Shell shell(0, 1);
+  shell.AddCommand(
+      "set",
+      [&](takina::ParseResult const &result, ArgList const &, std::string *errmsg) {
+        if (!result.IsSet(port_handle)) {
+          *errmsg = "set: port is required";
+          return false;
+        }
+        printf("port = %d, name = %s\n", port, name.c_str());
+        fflush(stdout);
+        return true;
+      }
+  );
+  // The ids of this line and the non-option arguments
+  shell.AddCommand(
+      "add",
+      [&](takina::ParseResult const &result, ArgList const &args, std::string *) {
+        printf("ids(%u):", result.Count(ids_handle));
+        for (auto id : ids) {
+          printf(" %d", id);
+        }
+        printf(", non-option arguments:");
+        for (auto arg : args) {
+          printf(" %s", arg);
+        }
+        printf("\n");
+        fflush(stdout);
+        return true;
+      }
+  );
+  shell.AddCommand("quit", [](takina::ParseResult const &, ArgList const &, std::string *) {
+    exit(0);
+    return true;
+  });
+
+  if (!shell.Run()) {
+    perror("shell");
+  }
+}
@@ -0,0 +1,45 @@
+#include "takina.h"
+
+#include <stdio.h>
+
+// Reconfigure twice, then try --help which keeps the current snapshot
+// e.g. ./snapshot_test
+struct Config {
+  int                      port = 80;
+  std::vector<std::string> peers;
+};
+
+static void Reconfigure(takina::ConfigSnapshot<Config> *config, std::vector<std::string> args)
+{
+  std::vector<char *> argv;
+  for (auto &arg : args) {
+    argv.push_back(&arg[0]);
+  }
+
+  std::string errmsg;
+  if (!config->Reconfigure(argv.data(), argv.data() + argv.size(), &errmsg)) {
+    printf("failed: %s\n", errmsg.c_str());
+  }
+
+  auto snapshot = config->Load();
+  printf("port = %d, peers =", snapshot->port);
+  for (auto const &peer : snapshot->peers) {
+    printf(" %s", peer.c_str());
+  }
+  printf("\n");
+}
+
+int main()
+{
+  takina::ConfigSnapshot<Config> config;
+  takina::AddOption({"p", "port", "Port number", "PORT"}, &config.Staging()->port);
+  takina::AddOption({"", "peers", "Peer addresses"}, &config.Staging()->peers);
+
+  auto old = config.Load();
+  Reconfigure(&config, {"-p", "8080", "--peers", "a", "b"});
+  // The peers are reset to the defaults, not appended
+  Reconfigure(&config, {"--peers", "c"});
+  Reconfigure(&config, {"-p", "1", "--help"});
+  // The snapshot held by reader is never modified
+  printf("old port = %d\n", old->port);
+}
@@ -10,6 +10,16 @@
 #include <vector>
 #include <limits>
 #include <cstdint>
+#include <algorithm> // remove_if()
+#include <atomic>
+#include <chrono> // milliseconds
+#include <errno.h>
+#include <fcntl.h> // open()
+#include <list>
+#include <sys/mman.h> // mmap()
+#include <sys/stat.h> // fstat()
+#include <thread>   // sleep_for()
+#include <unistd.h> // read(), write()
 
 namespace takina {
 
@@ -25,11 +35,45 @@ enum OptType : uint8_t {
   OT_MDOUBLE,
   OT_VOID, // No argument, use a boolean variable to indicates the option is set
   OT_USR,  // user-defined
+  OT_LAZY, // LazyValue<T>, the size is the maximum number of arguments
   OT_NUM,
 };
 
 static inline std::string const &OptType2Str(OptType t) noexcept;
 
+/* Parse() can't touch the protected fields of the LazyValueBase directly */
+struct LazyValueAccess {
+  static void Append(LazyValueBase *value, char const *arg, std::string const &cur_option)
+  {
+    if (value->args_.empty()) value->option_ = cur_option;
+    value->args_.push_back(arg);
+    value->converted_ = false;
+  }
+
+  static void Clear(LazyValueBase *value)
+  {
+    value->args_.clear();
+    value->owned_args_.clear();
+    value->converted_ = false;
+  }
+
+  // The arguments point to the config file which is unmapped by Teardown()
+  static void Own(LazyValueBase *value)
+  {
+    auto &owned = value->owned_args_;
+    owned.clear();
+    for (auto arg : value->args_) {
+      owned.append(arg, ::strlen(arg) + 1);
+    }
+
+    char const *arg = owned.data();
+    for (auto &cur : value->args_) {
+      cur = arg;
+      arg += ::strlen(arg) + 1;
+    }
+  }
+};
+
 struct OptionParameter {
   /* Because options will be parsed only once,
    * I don't use union to compress the space */
@@ -38,6 +82,10 @@ struct OptionParameter {
   void          *param = nullptr; // pointer to the user-defined varaible
   OptionFunction opt_fn{};
   std::string    type_hint;
+  std::string    name;            // long option, used for error message
+  std::string    section;         // used for checking the section of config file
+  unsigned int   id      = 0;     // dense index of the option, see Registry::params
+  bool           removed = false; // see RemoveSection()
 };
 
 /* FIXME
@@ -46,10 +94,7 @@ struct OptionParameter {
  * Besides, I think global function is easy to use.
  */
 
-// Help message
-static std::string help;
-static bool        has_help                       = false;
-static bool        enable_independent_non_opt_arg = false;
+static bool enable_independent_non_opt_arg = false;
 
 void EnableIndependentNonOptionArgument(bool opt) noexcept { enable_independent_non_opt_arg = opt; }
 
@@ -70,73 +115,363 @@ static std::string usage;
 static std::string description;
 
 /*
- * The long_param_map store the parameter object,
- * and the short_param_map just store the pointer to it.
- * Instread approach:
- * ```cpp
- * std::vector<OptionParameter> params;
- * std::unordered_map<std::string, OptionParameter*> long_param_map;
- * std::unordered_map<std::string, OptionParameter*> short_param_map;
- * ```
+ * The constraints are checked at the end of Parse().
+ * Each set of options is a bitset indexed by the option id,
+ * so checking a constraint is just some word-wide AND operations
+ * against the bitset of the options seen by Parse().
+ */
+typedef std::vector<uint64_t> Bitset;
+
+struct OptionDependency {
+  unsigned int id;       // the option which requires others
+  Bitset       required; // options required by it
+};
+
+struct OccurrenceLimit {
+  unsigned int id;
+  unsigned int min;
+  unsigned int max;
+};
+
+enum PositionalType : uint8_t {
+  PT_STR = 0,
+  PT_INT64,
+  PT_DOUBLE,
+};
+
+struct Positional {
+  std::string    name; // <name> or <name...>
+  std::string    desc;
+  PositionalType type;
+  bool           variadic = false; // param points to std::vector<T>
+  void          *param    = nullptr;
+};
+
+struct Section {
+  std::string                  name;
+  std::vector<OptionDescption> opts; // { short, long, desc }[]
+};
+
+/*
+ * All the options and their constraints.
+ *
+ * The published registry is never modified, Parse() holds a reference of it.
+ * The registration functions modify a private copy(draft) which is
+ * published atomically later(copy-on-write). Therefore, the options can be
+ * added or removed while other threads are parsing, and the old version
+ * is reclaimed when the last Parse() using it returns.
+ *
+ * Since the registry is copied, the OptionParameter objects are owned by
+ * params and the maps store the id instead of pointer, so they are still
+ * valid in the copy.
+ */
+struct Registry {
+  // id -> OptionParameter
+  // The id of removed option isn't reused, so the handle of it is not reused also.
+  std::vector<OptionParameter> params;
+
+  // long option -> id
+  std::unordered_map<std::string, unsigned int> long_param_map;
+
+  // short option -> id
+  std::unordered_map<std::string, unsigned int> short_param_map;
+
+  // In the FIFO order
+  // Register a dummy section to handle no section case
+  std::vector<Section> sections = {{"", {}}};
+
+  Bitset                        required_options;
+  std::vector<Bitset>           exclusive_groups;
+  std::vector<OptionDependency> dependencies;
+  std::vector<OccurrenceLimit>  occurrence_limits;
+
+  // In the order of declaration, only the last one can be variadic
+  std::vector<Positional> positionals;
+
+  // Ids of the OT_LAZY options, they are reset in each Parse()
+  std::vector<unsigned int> lazy_options;
+
+  unsigned int help_id = INVALID_OPTION_ID;
+  uint64_t     version = 0; // Unique in the process, see PublishDraft()
+};
+
+struct RegistryState {
+  std::mutex                      mutex; // Serialize the writers
+  std::shared_ptr<Registry const> published = std::make_shared<Registry const>();
+  std::shared_ptr<Registry>       draft; // Guarded by mutex
+  std::atomic<bool>               pending{false};
+
+  // The previous versions may be still used by Parse(), see Synchronize()
+  std::vector<std::weak_ptr<Registry const>> retired; // Guarded by mutex
+
+  // Never reset, even by Teardown(), so a cached parse result
+  // can't match a registry with the same version but different ids
+  uint64_t last_version = 0; // Guarded by mutex
+};
+
+/* Like GetNonOptionArguments(), options may be added in static initialization */
+static RegistryState &GetRegistryState()
+{
+  static RegistryState state;
+  return state;
+}
+
+// The thread is running the function passed to UpdateOptions(),
+// it has held the mutex.
+static thread_local bool in_update = false;
+
+static inline Registry &GetDraft(RegistryState &state)
+{
+  if (!state.draft) state.draft = std::make_shared<Registry>(*state.published);
+  return *state.draft;
+}
+
+static inline void PublishDraft(RegistryState &state)
+{
+  if (state.draft) {
+    state.draft->version = ++state.last_version;
+    auto &retired = state.retired;
+    retired.erase(
+        std::remove_if(
+            retired.begin(),
+            retired.end(),
+            [](std::weak_ptr<Registry const> const &registry) { return registry.expired(); }
+        ),
+        retired.end()
+    );
+    retired.push_back(state.published);
+    std::atomic_store(&state.published, std::shared_ptr<Registry const>(std::move(state.draft)));
+  }
+  state.pending.store(false, std::memory_order_release);
+}
+
+/*
+ * The changes out of UpdateOptions() are accumulated in the draft and
+ * published by the next Parse(), so adding many options at startup
+ * don't copy the registry many times.
+ */
+template <typename F>
+static inline auto ModifyRegistry(F &&fn) -> decltype(fn(std::declval<Registry &>()))
+{
+  auto &state = GetRegistryState();
+  if (in_update) return fn(GetDraft(state));
+
+  std::lock_guard<std::mutex> guard(state.mutex);
+  state.pending.store(true, std::memory_order_release);
+  return fn(GetDraft(state));
+}
+
+static inline std::shared_ptr<Registry const> LoadRegistry()
+{
+  auto &state = GetRegistryState();
+  if (state.pending.load(std::memory_order_acquire)) {
+    // Don't wait the UpdateOptions(), use the previous version instead
+    std::unique_lock<std::mutex> guard(state.mutex, std::try_to_lock);
+    if (guard.owns_lock()) PublishDraft(state);
+  }
+  return std::atomic_load(&state.published);
+}
+
+/*
+ * Cache of the parse results, keyed by the hash of argv.
  *
- * This make the process of long_param_map and short_param_map to same.
- * But the params is not necessary in fact.
- * Therefore, I don't define params.
+ * A successful Parse() records how the arguments are bound, i.e. the
+ * converted values, and the ParseResult. When the same argv is parsed
+ * again against the same version of registry, Parse() replays the
+ * records instead of looking up the options and converting the arguments.
+ * The string arguments are not copied, they are read from the argv
+ * by index since it is same as the cached one.
  */
+struct Assignment {
+  unsigned int id;       // option id, INVALID_OPTION_ID for non-option argument
+  unsigned int arg_num;  // cur_arg_num of SetParameter()
+  unsigned int argv_idx; // index of the argument
+  bool         positional; // id is the index of positional argument
+  union {
+    int     i;
+    int64_t l;
+    double  d;
+  } value;
+};
+
+struct ParseCacheEntry {
+  std::string             key; // All arguments separated by NUL
+  uint64_t                version;
+  bool                    independent_non_opt_arg; // It changes how the argv is bound
+  std::vector<Assignment> assignments;
+  ParseResult             result;
+};
+
+typedef std::shared_ptr<ParseCacheEntry const> ParseCacheEntryPtr;
 
-// long option -> OptionParameter
-static std::unordered_map<std::string, OptionParameter> long_param_map;
+struct ParseCache {
+  std::mutex                    mutex; // Guard the entries
+  std::atomic<size_t>           capacity{0};
+  std::list<ParseCacheEntryPtr> entries; // The most recently used is the front
+  std::unordered_map<uint64_t, std::list<ParseCacheEntryPtr>::iterator> hash_entry_map;
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+};
+
+static ParseCache &GetParseCache()
+{
+  static ParseCache cache;
+  return cache;
+}
 
-// short option -> OptionParameter
-static std::unordered_map<std::string, OptionParameter *> short_param_map;
+/*
+ * The mapped config files are kept until Teardown()
+ * since the lazy values point to them.
+ */
+struct ConfigFile {
+  void       *addr = nullptr;
+  size_t      len  = 0;
+  std::string last_line; // The last line without newline can't be terminated in place
+};
 
-// When there are some sections at least 1
-// section -> { short, long, desc }[]
-// Register a dummy section to handle no section case
-static std::unordered_map<std::string, std::vector<OptionDescption>> section_opt_map({{"", {}}});
+static std::list<ConfigFile> config_files;
+
+// The options set by the config file,
+// argv overrides them instead of appending the arguments.
+static Bitset config_file_options;
+
+// Indexed by option id, reported by ParseResult if not specified in argv.
+// The arguments are recorded for ApplyConfigFile(), they point to the mapped file.
+struct ConfigFileOption {
+  unsigned int              occurrences = 0;
+  unsigned int              count       = 0;
+  bool                      assigned    = false; // Any value is written
+  bool                      flag        = false; // The value of option without argument
+  std::vector<char const *> args;
+  std::vector<unsigned int> arg_nums; // cur_arg_num of SetParameter()
+};
 
-// To make the section output in the FIFO order
-// since the section_opt_map is unordered(hash table)
-static std::vector<std::string const *> sections = {&section_opt_map.begin()->first};
+static std::vector<ConfigFileOption> config_file_states;
 
 /* Store the non-options arguments */
 /* static std::vector<char const *> non_opt_args; */
 
 /* Utility function */
-static void AddOption_impl(OptDesc &&desc, OptionParameter opt_param);
+static OptionHandle AddOption_impl(OptDesc &&desc, OptionParameter opt_param);
+static OptionHandle RegisterOption(Registry *registry, OptDesc &&desc, OptionParameter opt_param);
 static void GenOptions(
     std::vector<OptionDescption> const &opts,
     int                                 long_opt_param_align_len,
-    int                                 short_opt_align_len
+    int                                 short_opt_align_len,
+    std::string                        *help
+);
+static void GenHelp(Registry const &registry, std::string *help);
+// The prefix of error message of positional argument, the default is "Option: "
+#define POSITIONAL_ERRMSG "Positional argument: "
+
+template <typename T>
+static bool StrInt(
+    T                 *param,
+    char const        *arg,
+    std::string const &cur_option,
+    std::string       *errmsg,
+    char const        *prefix = "Option: "
 );
-static void GenHelp();
-static bool StrInt(int *param, char const *arg, std::string const &cur_option, std::string *errmsg);
 static bool StrDouble(
     double            *param,
     char const        *arg,
     std::string const &cur_option,
-    std::string       *errmsg
+    std::string       *errmsg,
+    char const        *prefix = "Option: "
 );
 static bool SetParameter(
-    OptionParameter   *param,
-    char const        *arg,
-    unsigned int       cur_arg_num,
-    std::string const &cur_option,
-    std::string       *errmsg
+    OptionParameter const *param,
+    char const            *arg,
+    unsigned int           cur_arg_num,
+    std::string const     &cur_option,
+    std::string           *errmsg
 );
+static void ClearParameter(OptionParameter const *param);
+static void ReplayPositional(Positional const &pos, char const *arg, Assignment const &assignment);
+static void ClearPositional(Positional const &pos);
 static bool CheckArgumentIsLess(
-    OptionParameter   *cur_param,
-    std::string const &cur_option,
-    unsigned int       cur_arg_num,
-    std::string       *errmsg
+    OptionParameter const *cur_param,
+    std::string const     &cur_option,
+    unsigned int           cur_arg_num,
+    std::string           *errmsg
 );
 static bool CheckArgumentIsGreater(
-    OptionParameter   *cur_param,
-    std::string const &cur_option,
-    unsigned int       cur_arg_num,
+    OptionParameter const *cur_param,
+    std::string const     &cur_option,
+    unsigned int           cur_arg_num,
+    std::string           *errmsg
+);
+static bool ParseArguments_impl(
+    char                     **argv_begin,
+    char                     **argv_end,
+    std::string               *errmsg,
+    ParseResult               *result,
+    bool                      *has_help,
+    std::vector<char const *> *non_opt_args,
+    bool                       replace
+);
+static uint64_t HashString(std::string const &key) noexcept;
+static unsigned int MaxArgumentNum(OptionParameter const *cur_param) noexcept;
+static bool FindOptionId(Registry const &registry, std::string const &lopt, unsigned int *id);
+static void RecordAssignment(
+    ParseCacheEntry       *entry,
+    OptionParameter const *param,
+    unsigned int           cur_arg_num,
+    unsigned int           argv_idx
+);
+static bool ReplayAssignments(
+    Registry const            &registry,
+    ParseCacheEntry const     &entry,
+    char                     **argv_begin,
+    std::vector<char const *> *non_opt_args,
+    bool                       replace,
+    std::string               *errmsg
+);
+static bool FillPositional(
+    Positional const *pos,
+    unsigned int      pos_idx,
+    char           ***argv_cur,
+    char            **argv_end,
+    char            **argv_first,
+    ParseCacheEntry  *entry,
+    std::string      *errmsg
+);
+static bool CheckConstraints(
+    Registry const    &registry,
+    ParseResult const &result,
     std::string       *errmsg
 );
 
+static inline size_t BitsetWordNum(size_t bit_num) noexcept { return (bit_num + 63) >> 6; }
+
+static inline void BitsetSet(Bitset *set, unsigned int id)
+{
+  if (set->size() <= (id >> 6)) set->resize((id >> 6) + 1);
+  (*set)[id >> 6] |= uint64_t(1) << (id & 63);
+}
+
+static inline void BitsetReset(Bitset *set, unsigned int id) noexcept
+{
+  if ((id >> 6) < set->size()) (*set)[id >> 6] &= ~(uint64_t(1) << (id & 63));
+}
+
+static inline bool BitsetTest(Bitset const &set, unsigned int id) noexcept
+{
+  return (id >> 6) < set.size() && ((set[id >> 6] >> (id & 63)) & 1);
+}
+
+static inline void BitsetClear(Bitset *set, Bitset const &other) noexcept
+{
+  for (size_t i = 0; i < set->size() && i < other.size(); ++i) {
+    (*set)[i] &= ~other[i];
+  }
+}
+
+static inline unsigned int BitsetFirst(size_t word_idx, uint64_t word) noexcept
+{
+  return unsigned(word_idx << 6) + __builtin_ctzll(word);
+}
+
 void AddUsage(std::string const &desc)
 {
   usage.reserve(7 + desc.size() + 1);
@@ -153,28 +488,142 @@ void AddDescription(std::string const &desc)
 
 void AddSection(std::string &&section)
 {
-  auto res = section_opt_map.insert({std::move(section), {}});
+  ModifyRegistry([&section](Registry &registry) {
+    for (auto const &sec : registry.sections) {
+      if (sec.name == section) {
+        ::fprintf(stderr, "The section %s does exists!\n", section.c_str());
+        return;
+      }
+    }
+    registry.sections.push_back({std::move(section), {}});
+  });
+}
+
+void RemoveSection(std::string const &section)
+{
+  if (section.empty()) return;
 
-  if (!res.second) {
-    ::fprintf(stderr, "The section %s does exists!\n", section.c_str());
+  ModifyRegistry([&section](Registry &registry) {
+    auto &sections = registry.sections;
+    auto  sec_iter = sections.begin();
+    for (; sec_iter != sections.end(); ++sec_iter) {
+      if (sec_iter->name == section) break;
+    }
+
+    if (sec_iter == sections.end()) {
+      ::fprintf(stderr, "The section %s does not exists!\n", section.c_str());
+      return;
+    }
+
+    Bitset removed;
+    for (auto const &opt : sec_iter->opts) {
+      auto iter = registry.long_param_map.find(opt.lopt);
+      assert(iter != registry.long_param_map.end());
+      const unsigned int id = iter->second;
+      BitsetSet(&removed, id);
+      // Drop the variable and callback of plugin, the copies in the previous
+      // versions are released after Synchronize(), then the plugin can be unloaded
+      registry.params[id]         = OptionParameter{};
+      registry.params[id].id      = id;
+      registry.params[id].removed = true;
+      registry.long_param_map.erase(iter);
+      if (!opt.sopt.empty()) registry.short_param_map.erase(opt.sopt);
+    }
+    sections.erase(sec_iter);
+
+    // The help is added to the last section by the first Parse(),
+    // which may be the plugin section. Add it again in the next Parse().
+    if (BitsetTest(removed, registry.help_id)) registry.help_id = INVALID_OPTION_ID;
+
+    auto &lazy_options = registry.lazy_options;
+    lazy_options.erase(
+        std::remove_if(
+            lazy_options.begin(),
+            lazy_options.end(),
+            [&removed](unsigned int id) { return BitsetTest(removed, id); }
+        ),
+        lazy_options.end()
+    );
+
+    // Remove the constraints referring to the removed options
+    BitsetClear(&registry.required_options, removed);
+    for (auto &group : registry.exclusive_groups) {
+      BitsetClear(&group, removed);
+    }
+    for (auto &dependency : registry.dependencies) {
+      BitsetClear(&dependency.required, removed);
+    }
+    auto &dependencies = registry.dependencies;
+    dependencies.erase(
+        std::remove_if(
+            dependencies.begin(),
+            dependencies.end(),
+            [&removed](OptionDependency const &dependency) {
+              return BitsetTest(removed, dependency.id);
+            }
+        ),
+        dependencies.end()
+    );
+    auto &limits = registry.occurrence_limits;
+    limits.erase(
+        std::remove_if(
+            limits.begin(),
+            limits.end(),
+            [&removed](OccurrenceLimit const &limit) { return BitsetTest(removed, limit.id); }
+        ),
+        limits.end()
+    );
+  });
+}
+
+void UpdateOptions(std::function<void()> const &fn)
+{
+  auto &state = GetRegistryState();
+  if (in_update) {
+    // Nested, the outer one will publish the changes
+    fn();
     return;
   }
-  // FIXME
-  sections.emplace_back(&res.first->first);
+
+  std::lock_guard<std::mutex> guard(state.mutex);
+  in_update = true;
+  GetDraft(state);
+  fn();
+  in_update = false;
+  PublishDraft(state);
+}
+
+void Synchronize()
+{
+  auto                                       &state = GetRegistryState();
+  std::vector<std::weak_ptr<Registry const>> retired;
+  {
+    std::lock_guard<std::mutex> guard(state.mutex);
+    // The changes out of UpdateOptions() are not published yet
+    if (state.pending.load(std::memory_order_acquire)) PublishDraft(state);
+    retired = state.retired;
+  }
+
+  // The Parse() is short, so just poll instead of notifying in it
+  for (auto const &registry : retired) {
+    while (!registry.expired()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
 }
 
-void AddOption(OptDesc &&desc, bool *param)
+OptionHandle AddOption(OptDesc &&desc, bool *param)
 {
   *param = false;
   OptionParameter opt;
   opt.type        = OT_VOID;
   opt.param       = param;
   desc.param_name = OptType2Str(opt.type);
-  AddOption_impl(std::move(desc), opt);
+  return AddOption_impl(std::move(desc), opt);
 }
 
 #define DEFINE_ADD_OPTION(_ptype, _type)                                                           \
-  void AddOption(OptDesc &&desc, _ptype *param)                                                    \
+  OptionHandle AddOption(OptDesc &&desc, _ptype *param)                                            \
   {                                                                                                \
     OptionParameter opt;                                                                           \
     opt.type  = _type;                                                                             \
@@ -183,7 +632,7 @@ void AddOption(OptDesc &&desc, bool *param)
     desc.param_name = '<';                                                                         \
     desc.param_name += OptType2Str(opt.type);                                                      \
     desc.param_name += '>';                                                                        \
-    AddOption_impl(std::move(desc), opt);                                                          \
+    return AddOption_impl(std::move(desc), opt);                                                   \
   }
 
 DEFINE_ADD_OPTION(std::string, OT_STR)
@@ -191,7 +640,7 @@ DEFINE_ADD_OPTION(int, OT_INT)
 DEFINE_ADD_OPTION(double, OT_DOUBLE)
 
 #define DEFINE_ADD_OPTION_MULTI(_ptype, _type)                                                     \
-  void AddOption(OptDesc &&desc, _ptype *param)                                                    \
+  OptionHandle AddOption(OptDesc &&desc, _ptype *param)                                            \
   {                                                                                                \
     OptionParameter opt;                                                                           \
     opt.type  = _type;                                                                             \
@@ -200,7 +649,7 @@ DEFINE_ADD_OPTION(double, OT_DOUBLE)
     desc.param_name = "<n ";                                                                       \
     desc.param_name += OptType2Str(opt.type);                                                      \
     desc.param_name += '>';                                                                        \
-    AddOption_impl(std::move(desc), opt);                                                          \
+    return AddOption_impl(std::move(desc), opt);                                                   \
   }
 
 DEFINE_ADD_OPTION_MULTI(std::vector<std::string>, OT_MSTR)
@@ -208,7 +657,7 @@ DEFINE_ADD_OPTION_MULTI(std::vector<int>, OT_MINT)
 DEFINE_ADD_OPTION_MULTI(std::vector<double>, OT_MDOUBLE)
 
 #define DEFINE_ADD_OPTION_FIXED(_ptype, _type)                                                     \
-  void AddOption(OptDesc &&desc, _ptype *param, unsigned int n)                                    \
+  OptionHandle AddOption(OptDesc &&desc, _ptype *param, unsigned int n)                            \
   {                                                                                                \
     OptionParameter opt;                                                                           \
     opt.type     = _type;                                                                          \
@@ -222,172 +671,643 @@ DEFINE_ADD_OPTION_MULTI(std::vector<double>, OT_MDOUBLE)
     desc.param_name += ' ';                                                                        \
     desc.param_name += OptType2Str(opt.type);                                                      \
     desc.param_name += '>';                                                                        \
-    AddOption_impl(std::move(desc), opt);                                                          \
+    return AddOption_impl(std::move(desc), opt);                                                   \
   }
 
 DEFINE_ADD_OPTION_FIXED(std::string, OT_FSTR)
 DEFINE_ADD_OPTION_FIXED(int, OT_FINT)
 DEFINE_ADD_OPTION_FIXED(double, OT_FDOUBLE)
 
-void AddOption(OptDesc &&desc, OptionFunction fn, unsigned int n)
+OptionHandle AddOption(OptDesc &&desc, OptionFunction fn, unsigned int n)
 {
   OptionParameter opt;
   opt.type   = OT_USR;
   opt.size   = n;
   opt.opt_fn = std::move(fn);
-  AddOption_impl(std::move(desc), std::move(opt));
+  return AddOption_impl(std::move(desc), std::move(opt));
 }
 
-#define CHECK_OPTION_EXISTS(iter, _map)                                                            \
-  auto iter = _map.find(cur_option);                                                               \
-  if (iter == _map.end()) {                                                                        \
-    *errmsg = "Option: ";                                                                          \
-    *errmsg += cur_option;                                                                         \
-    *errmsg += " is not an valid option. Please type --help to check all "                         \
-               "allowed options";                                                                  \
-    return false;                                                                                  \
+// The parameter name is same as the eager version
+#define DEFINE_ADD_OPTION_LAZY(_ptype, _type, _size, _prefix)                                      \
+  OptionHandle AddOption(OptDesc &&desc, LazyValue<_ptype> *param)                                 \
+  {                                                                                                \
+    OptionParameter opt;                                                                           \
+    opt.type  = OT_LAZY;                                                                           \
+    opt.size  = _size;                                                                             \
+    opt.param = static_cast<LazyValueBase *>(param);                                               \
+    desc.param_name.reserve(sizeof(_prefix) + OptType2Str(_type).size());                          \
+    desc.param_name = _prefix;                                                                     \
+    desc.param_name += OptType2Str(_type);                                                         \
+    desc.param_name += '>';                                                                        \
+    return AddOption_impl(std::move(desc), opt);                                                   \
   }
 
-bool Parse(char **argv_begin, char **argv_end, std::string *errmsg)
+DEFINE_ADD_OPTION_LAZY(int, OT_INT, 1, "<")
+DEFINE_ADD_OPTION_LAZY(double, OT_DOUBLE, 1, "<")
+DEFINE_ADD_OPTION_LAZY(std::vector<int>, OT_MINT, MAX_OPTION_ARGS_NUM, "<n ")
+DEFINE_ADD_OPTION_LAZY(std::vector<double>, OT_MDOUBLE, MAX_OPTION_ARGS_NUM, "<n ")
+
+static void AddPositional_impl(PosDesc &&desc, Positional pos)
 {
-  OptionParameter *cur_param = nullptr;
-  std::string      cur_option;
-  unsigned int     cur_arg_num = 0;
-  errmsg->clear();
-  AddOption({"", "help", "Display the help message"}, &has_help);
+  pos.name.reserve(desc.name.size() + 5);
+  pos.name = '<';
+  pos.name += desc.name;
+  pos.name += pos.variadic ? "...>" : ">";
+  pos.desc = std::move(desc.desc);
+
+  ModifyRegistry([&pos](Registry &registry) {
+    auto &positionals = registry.positionals;
+    if (!positionals.empty() && positionals.back().variadic) {
+      ::fprintf(
+          stderr,
+          "The positional argument: %s is after the variadic one\n",
+          pos.name.c_str()
+      );
+      return;
+    }
+    positionals.push_back(std::move(pos));
+  });
+}
 
-  for (; argv_begin != argv_end; ++argv_begin) {
-    char const  *arg = *argv_begin;
-    const size_t len = ::strlen(arg);
-    assert(len != 0);
+#define DEFINE_ADD_POSITIONAL(_ptype, _type, _variadic)                                            \
+  void AddPositional(PosDesc &&desc, _ptype *param)                                                \
+  {                                                                                                \
+    Positional pos;                                                                                \
+    pos.type     = _type;                                                                          \
+    pos.variadic = _variadic;                                                                      \
+    pos.param    = param;                                                                          \
+    AddPositional_impl(std::move(desc), std::move(pos));                                           \
+  }
 
-    bool is_long_opt  = (arg[0] == '-' && arg[1] == '-') && len > 2;
-    bool is_short_opt = (arg[0] == '-') && len > 1;
+DEFINE_ADD_POSITIONAL(std::string, PT_STR, false)
+DEFINE_ADD_POSITIONAL(int64_t, PT_INT64, false)
+DEFINE_ADD_POSITIONAL(double, PT_DOUBLE, false)
+DEFINE_ADD_POSITIONAL(std::vector<std::string>, PT_STR, true)
+DEFINE_ADD_POSITIONAL(std::vector<int64_t>, PT_INT64, true)
+DEFINE_ADD_POSITIONAL(std::vector<double>, PT_DOUBLE, true)
 
-    // Check if is a option
-    // short option or long option
-    // PS: ---+ shouldn't think as a option.
-    if (is_long_opt || is_short_opt) {
-      if (CheckArgumentIsLess(cur_param, cur_option, cur_arg_num, errmsg)) return false;
+void AddRequired(std::string const &lopt)
+{
+  ModifyRegistry([&](Registry &registry) {
+    unsigned int id;
+    if (!FindOptionId(registry, lopt, &id)) return;
+    BitsetSet(&registry.required_options, id);
+  });
+}
 
-      cur_arg_num = 0;
+void AddExclusive(std::vector<std::string> const &lopts)
+{
+  ModifyRegistry([&](Registry &registry) {
+    Bitset group;
+    for (auto const &lopt : lopts) {
+      unsigned int id;
+      if (!FindOptionId(registry, lopt, &id)) return;
+      BitsetSet(&group, id);
+    }
+    registry.exclusive_groups.push_back(std::move(group));
+  });
+}
 
-      // long option
-      if (arg[1] == '-') {
-        cur_option = std::string(&arg[2], len - 2);
-        CHECK_OPTION_EXISTS(iter, long_param_map)
-        cur_param = &iter->second;
-      } else {
-        // short option
-        cur_option = std::string(&arg[1], len - 1);
-        CHECK_OPTION_EXISTS(iter, short_param_map)
-        cur_param = iter->second;
-      }
+void AddDependency(std::string const &lopt, std::string const &required_lopt)
+{
+  ModifyRegistry([&](Registry &registry) {
+    unsigned int id;
+    unsigned int required_id;
+    if (!FindOptionId(registry, lopt, &id) || !FindOptionId(registry, required_lopt, &required_id)) {
+      return;
+    }
 
-      if (cur_param->type == OT_VOID) {
-        *(bool *)(cur_param->param) = true;
-      }
-    } else {
-      // Non option arguments
-      if (!cur_param) {
-        if (enable_independent_non_opt_arg) {
-          GetNonOptionArguments().push_back(arg);
-          continue;
-        } else {
-          *errmsg += "No option, invalid argument";
-          return false;
-        }
-      }
-      cur_arg_num++;
-      if (CheckArgumentIsGreater(cur_param, cur_option, cur_arg_num, errmsg)) {
-        if (enable_independent_non_opt_arg) {
-          GetNonOptionArguments().push_back(arg);
-        } else {
-          return false;
-        }
-      } else {
-        if (!SetParameter(cur_param, arg, cur_arg_num, cur_option, errmsg)) {
-          return false;
-        }
+    auto &dependencies = registry.dependencies;
+    for (auto &dependency : registry.dependencies) {
+      if (dependency.id == id) {
+        BitsetSet(&dependency.required, required_id);
+        return;
       }
     }
+    dependencies.push_back({id, {}});
+    BitsetSet(&dependencies.back().required, required_id);
+  });
+}
 
-    if (has_help) {
-      // Only generate help when help is specified
-      GenHelp();
-      ::fputs(help.c_str(), stdout);
-      ::exit(0);
-      return true;
-    }
+void SetOccurrence(std::string const &lopt, unsigned int min, unsigned int max)
+{
+  ModifyRegistry([&](Registry &registry) {
+    unsigned int id;
+    if (!FindOptionId(registry, lopt, &id)) return;
+    registry.occurrence_limits.push_back({id, min, max});
+  });
+}
+
+/* Parse() fills the ParseResult through it */
+struct ParseResultAccess {
+  typedef ParseResult::OptionState OptionState;
+
+  static void Reset(ParseResult *result, size_t option_num)
+  {
+    // Keep the capacity
+    result->seen_.assign(BitsetWordNum(option_num), 0);
+    result->states_.assign(option_num, OptionState{});
+    result->positional_count_ = 0;
   }
 
-  if (CheckArgumentIsLess(cur_param, cur_option, cur_arg_num, errmsg)) return false;
+  static unsigned int &PositionalCount(ParseResult &result) noexcept
+  {
+    return result.positional_count_;
+  }
 
-  return true;
-}
+  static Bitset       &Seen(ParseResult &result) noexcept { return result.seen_; }
+  static Bitset const &Seen(ParseResult const &result) noexcept { return result.seen_; }
 
-void DebugPrint()
-{
-#ifdef TAKINA_DEBUG
-  printf("======= Debug Print =======\n");
-  printf("All long options: \n");
-  for (auto const &long_opt : long_param_map) {
-    printf("--%s\n", long_opt.first.c_str());
+  static std::vector<OptionState> &States(ParseResult &result) noexcept { return result.states_; }
+  static std::vector<OptionState> const &States(ParseResult const &result) noexcept
+  {
+    return result.states_;
   }
+};
 
-  printf("All short options: \n");
-  for (auto const &short_opt : short_param_map) {
-    printf("-%s\n", short_opt.first.c_str());
+/*
+ * The options set by config file and not overridden by argv are also
+ * specified, so they satisfy the constraints as the options in argv.
+ */
+static inline void ApplyConfigFileOptions(ParseResult *result)
+{
+  auto &seen   = ParseResultAccess::Seen(*result);
+  auto &states = ParseResultAccess::States(*result);
+
+  for (size_t i = 0; i < config_file_options.size(); ++i) {
+    for (uint64_t word = config_file_options[i]; word; word &= word - 1) {
+      const unsigned int id = BitsetFirst(i, word);
+      // The registry of this parse may be older than the config file
+      if (id >= states.size() || states[id].occurrences != 0) continue;
+      BitsetSet(&seen, id);
+      states[id].occurrences = config_file_states[id].occurrences;
+      states[id].count       = config_file_states[id].count;
+    }
   }
-  puts("");
-#endif
 }
 
-static inline void Teardown(std::string *str)
+// The variadic positional argument consumes all the following non-option arguments
+#define FILL_POSITIONAL_ROUTINE                                                                    \
+  {                                                                                                \
+    auto   pos   = &positionals[pos_idx];                                                          \
+    char **first = argv_begin;                                                                     \
+    if (!FillPositional(pos, pos_idx, &argv_begin, argv_end, argv_first, entry.get(), errmsg)) {   \
+      return false;                                                                                \
+    }                                                                                              \
+    ParseResultAccess::PositionalCount(*result) += unsigned(argv_begin - first) + 1;               \
+    if (!pos->variadic) ++pos_idx;                                                                 \
+  }
+
+#define CHECK_OPTION_EXISTS(iter, _map)                                                            \
+  auto iter = _map.find(cur_option);                                                               \
+  if (iter == _map.end()) {                                                                        \
+    *errmsg = "Option: ";                                                                          \
+    *errmsg += cur_option;                                                                         \
+    *errmsg += " is not an valid option. Please type --help to check all "                         \
+               "allowed options";                                                                  \
+    return false;                                                                                  \
+  }
+
+void EnableParseCache(size_t capacity)
 {
-  str->clear();
-  str->shrink_to_fit();
+  auto                       &cache = GetParseCache();
+  std::lock_guard<std::mutex> guard(cache.mutex);
+  cache.capacity.store(capacity, std::memory_order_relaxed);
+  while (cache.entries.size() > capacity) {
+    cache.hash_entry_map.erase(HashString(cache.entries.back()->key));
+    cache.entries.pop_back();
+  }
 }
 
-template <typename T>
-static inline void Teardown(std::vector<T> *vec)
+ParseCacheStats GetParseCacheStats() noexcept
 {
-  vec->clear();
-  vec->shrink_to_fit();
+  auto &cache = GetParseCache();
+  return {cache.hits.load(std::memory_order_relaxed), cache.misses.load(std::memory_order_relaxed)};
 }
 
-template <typename T>
-static inline void Teardown(T *cont)
+/* FNV-1a, the arguments are separated by NUL as the key */
+static inline uint64_t HashBytes(uint64_t hash, char const *data, size_t len) noexcept
 {
-  cont->clear();
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static inline uint64_t HashString(std::string const &key) noexcept
+{
+  return HashBytes(14695981039346656037ULL, key.data(), key.size());
+}
+
+static inline uint64_t HashArguments(char **argv_begin, char **argv_end) noexcept
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (; argv_begin != argv_end; ++argv_begin) {
+    hash = HashBytes(hash, *argv_begin, ::strlen(*argv_begin) + 1);
+  }
+  return hash;
+}
+
+static inline bool MatchArguments(std::string const &key, char **argv_begin, char **argv_end)
+{
+  size_t pos = 0;
+  for (; argv_begin != argv_end; ++argv_begin) {
+    const size_t len = ::strlen(*argv_begin) + 1;
+    if (key.size() - pos < len || ::memcmp(key.data() + pos, *argv_begin, len) != 0) return false;
+    pos += len;
+  }
+  return pos == key.size();
+}
+
+static ParseCacheEntryPtr
+FindParseCache(uint64_t hash, Registry const &registry, char **argv_begin, char **argv_end)
+{
+  auto                       &cache = GetParseCache();
+  std::lock_guard<std::mutex> guard(cache.mutex);
+
+  auto iter = cache.hash_entry_map.find(hash);
+  if (iter != cache.hash_entry_map.end()) {
+    auto const &entry = *iter->second;
+    // The options or EnableIndependentNonOptionArgument() may be changed after cached
+    if (entry->version == registry.version &&
+        entry->independent_non_opt_arg == enable_independent_non_opt_arg &&
+        MatchArguments(entry->key, argv_begin, argv_end))
+    {
+      cache.entries.splice(cache.entries.begin(), cache.entries, iter->second);
+      cache.hits.fetch_add(1, std::memory_order_relaxed);
+      return entry;
+    }
+  }
+
+  cache.misses.fetch_add(1, std::memory_order_relaxed);
+  return nullptr;
+}
+
+static void InsertParseCache(
+    uint64_t                         hash,
+    std::unique_ptr<ParseCacheEntry> entry,
+    char                           **argv_begin,
+    char                           **argv_end
+)
+{
+  for (; argv_begin != argv_end; ++argv_begin) {
+    entry->key.append(*argv_begin, ::strlen(*argv_begin) + 1);
+  }
+
+  auto                       &cache = GetParseCache();
+  std::lock_guard<std::mutex> guard(cache.mutex);
+  if (cache.capacity.load(std::memory_order_relaxed) == 0) return;
+
+  // Replace the stale or collided entry
+  auto iter = cache.hash_entry_map.find(hash);
+  if (iter != cache.hash_entry_map.end()) {
+    cache.entries.erase(iter->second);
+    cache.hash_entry_map.erase(iter);
+  }
+
+  if (cache.entries.size() == cache.capacity.load(std::memory_order_relaxed)) {
+    cache.hash_entry_map.erase(HashString(cache.entries.back()->key));
+    cache.entries.pop_back();
+  }
+
+  cache.entries.emplace_front(std::move(entry));
+  cache.hash_entry_map[hash] = cache.entries.begin();
+}
+
+bool Parse(char **argv_begin, char **argv_end, std::string *errmsg, ParseResult *result)
+{
+  bool has_help = false;
+  if (!ParseArguments(argv_begin, argv_end, errmsg, result, &has_help)) return false;
+
+  if (has_help) {
+    std::string help;
+    GenHelp(*LoadRegistry(), &help);
+    ::fputs(help.c_str(), stdout);
+    ::exit(0);
+  }
+  return true;
+}
+
+/*
+ * Parse() exits the process when --help is specified,
+ * but the Shell and ConfigSnapshot should continue.
+ * Set *has_help in this case, the caller generates the help message
+ * into its own string, since the Shells may run in different threads.
+ */
+bool ParseArguments(
+    char                     **argv_begin,
+    char                     **argv_end,
+    std::string               *errmsg,
+    ParseResult               *result,
+    bool                      *has_help,
+    std::vector<char const *> *non_opt_args
+)
+{
+  return ParseArguments_impl(
+      argv_begin,
+      argv_end,
+      errmsg,
+      result,
+      has_help,
+      non_opt_args ? non_opt_args : &GetNonOptionArguments(),
+      false
+  );
+}
+
+/*
+ * The non-option arguments are pushed to non_opt_args.
+ * If replace is true, the multi-value options and the variadic positional
+ * argument are replaced instead of appended, e.g. each line of the Shell.
+ * Otherwise, only the options set by config file are replaced.
+ */
+static bool ParseArguments_impl(
+    char                     **argv_begin,
+    char                     **argv_end,
+    std::string               *errmsg,
+    ParseResult               *result,
+    bool                      *has_help,
+    std::vector<char const *> *non_opt_args,
+    bool                       replace
+)
+{
+  OptionParameter const *cur_param = nullptr;
+  std::string            cur_option;
+  unsigned int           cur_arg_num = 0;
+  char **const           argv_first  = argv_begin;
+  errmsg->clear();
+
+  auto registry = LoadRegistry();
+  // Parse() may be called many times, e.g. ConfigSnapshot::Reconfigure()
+  if (registry->help_id == INVALID_OPTION_ID) {
+    ModifyRegistry([](Registry &draft) {
+      if (draft.help_id != INVALID_OPTION_ID) return;
+      // The help is checked by id, no variable is bound
+      OptionParameter opt;
+      opt.type      = OT_VOID;
+      draft.help_id = RegisterOption(&draft, {"", "help", "Display the help message"}, opt).id;
+    });
+    registry = LoadRegistry();
+  }
+  auto const &long_param_map  = registry->long_param_map;
+  auto const &short_param_map = registry->short_param_map;
+  auto const &params          = registry->params;
+  auto const &positionals     = registry->positionals;
+  unsigned int pos_idx        = 0; // The positional argument to be filled
+
+  ParseResultAccess::Reset(result, params.size());
+  auto &seen   = ParseResultAccess::Seen(*result);
+  auto &states = ParseResultAccess::States(*result);
+
+  // Each parse replaces the arguments of lazy values instead of appending,
+  // the previous ones may point to the freed argv.
+  // The values set by config file are kept until overridden.
+  for (auto id : registry->lazy_options) {
+    auto value = (LazyValueBase *)(params[id].param);
+    if (!value->Arguments().empty() && !BitsetTest(config_file_options, id)) {
+      LazyValueAccess::Clear(value);
+    }
+  }
+
+  if (replace && !positionals.empty() && positionals.back().variadic) {
+    ClearPositional(positionals.back());
+  }
+
+  auto                           &cache = GetParseCache();
+  std::unique_ptr<ParseCacheEntry> entry;
+  uint64_t                         hash = 0;
+  if (cache.capacity.load(std::memory_order_relaxed) != 0) {
+    hash = HashArguments(argv_begin, argv_end);
+    if (auto hit = FindParseCache(hash, *registry, argv_begin, argv_end)) {
+      if (!ReplayAssignments(*registry, *hit, argv_begin, non_opt_args, replace, errmsg)) {
+        return false;
+      }
+      // The config file may be loaded after cached
+      *result = hit->result;
+      ApplyConfigFileOptions(result);
+      return CheckConstraints(*registry, *result, errmsg);
+    }
+    entry.reset(new ParseCacheEntry);
+    entry->version                 = registry->version;
+    entry->independent_non_opt_arg = enable_independent_non_opt_arg;
+  }
+
+  for (; argv_begin != argv_end; ++argv_begin) {
+    // The argument may be empty, e.g. "" in the Shell
+    char const  *arg = *argv_begin;
+    const size_t len = ::strlen(arg);
+
+    bool is_long_opt  = (arg[0] == '-' && arg[1] == '-') && len > 2;
+    bool is_short_opt = (arg[0] == '-') && len > 1;
+
+    // Check if is a option
+    // short option or long option
+    // PS: ---+ shouldn't think as a option.
+    if (is_long_opt || is_short_opt) {
+      if (CheckArgumentIsLess(cur_param, cur_option, cur_arg_num, errmsg)) return false;
+
+      cur_arg_num = 0;
+
+      // long option
+      if (arg[1] == '-') {
+        cur_option = std::string(&arg[2], len - 2);
+        CHECK_OPTION_EXISTS(iter, long_param_map)
+        cur_param = &params[iter->second];
+      } else {
+        // short option
+        cur_option = std::string(&arg[1], len - 1);
+        CHECK_OPTION_EXISTS(iter, short_param_map)
+        cur_param = &params[iter->second];
+      }
+
+      if (states[cur_param->id].occurrences == 0 &&
+          (replace || BitsetTest(config_file_options, cur_param->id)))
+      {
+        ClearParameter(cur_param);
+      }
+
+      BitsetSet(&seen, cur_param->id);
+      states[cur_param->id].occurrences++;
+      states[cur_param->id].argv_index = int(argv_begin - argv_first);
+
+      if (cur_param->id == registry->help_id) {
+        *has_help = true;
+        return true;
+      }
+
+      if (cur_param->type == OT_VOID) {
+        *(bool *)(cur_param->param) = true;
+        if (entry) RecordAssignment(entry.get(), cur_param, 0, argv_begin - argv_first);
+      }
+    } else {
+      // Non option arguments
+      if (!cur_param) {
+        if (pos_idx < positionals.size()) {
+          FILL_POSITIONAL_ROUTINE
+          continue;
+        }
+        if (enable_independent_non_opt_arg) {
+          non_opt_args->push_back(arg);
+          if (entry) RecordAssignment(entry.get(), nullptr, 0, argv_begin - argv_first);
+          continue;
+        } else {
+          *errmsg += "No option, invalid argument";
+          return false;
+        }
+      }
+      cur_arg_num++;
+      if (cur_arg_num > MaxArgumentNum(cur_param) && pos_idx < positionals.size()) {
+        // The extra arguments of option are positional arguments also
+        FILL_POSITIONAL_ROUTINE
+      } else if (CheckArgumentIsGreater(cur_param, cur_option, cur_arg_num, errmsg)) {
+        if (enable_independent_non_opt_arg) {
+          non_opt_args->push_back(arg);
+          if (entry) RecordAssignment(entry.get(), nullptr, 0, argv_begin - argv_first);
+        } else {
+          return false;
+        }
+      } else {
+        if (!SetParameter(cur_param, arg, cur_arg_num, cur_option, errmsg)) {
+          return false;
+        }
+        states[cur_param->id].count++;
+        if (entry) RecordAssignment(entry.get(), cur_param, cur_arg_num, argv_begin - argv_first);
+      }
+    }
+  }
+
+  if (CheckArgumentIsLess(cur_param, cur_option, cur_arg_num, errmsg)) return false;
+
+  if (pos_idx < positionals.size() && !positionals[pos_idx].variadic) {
+    *errmsg = POSITIONAL_ERRMSG;
+    *errmsg += positionals[pos_idx].name;
+    *errmsg += " is required";
+    return false;
+  }
+
+  // Cache the result of argv only, the config file options are applied when hit
+  if (entry) entry->result = *result;
+  ApplyConfigFileOptions(result);
+  if (!CheckConstraints(*registry, *result, errmsg)) return false;
+
+  if (entry) InsertParseCache(hash, std::move(entry), argv_first, argv_end);
+  return true;
+}
+
+bool ValidateAll(std::string *errmsg)
+{
+  errmsg->clear();
+  auto registry = LoadRegistry();
+  for (auto const &param : registry->params) {
+    if (param.type != OT_LAZY || param.removed) continue;
+    if (!((LazyValueBase *)(param.param))->Convert(errmsg)) return false;
+  }
+  return true;
+}
+
+void DebugPrint()
+{
+#ifdef TAKINA_DEBUG
+  auto registry = LoadRegistry();
+  printf("======= Debug Print =======\n");
+  printf("All long options: \n");
+  for (auto const &long_opt : registry->long_param_map) {
+    printf("--%s\n", long_opt.first.c_str());
+  }
+
+  printf("All short options: \n");
+  for (auto const &short_opt : registry->short_param_map) {
+    printf("-%s\n", short_opt.first.c_str());
+  }
+  puts("");
+#endif
+}
+
+static inline void Teardown(std::string *str)
+{
+  str->clear();
+  str->shrink_to_fit();
+}
+
+template <typename T>
+static inline void Teardown(std::vector<T> *vec)
+{
+  vec->clear();
+  vec->shrink_to_fit();
+}
+
+template <typename T>
+static inline void Teardown(T *cont)
+{
+  cont->clear();
 }
 
 #define TAKINA_TEARDOWN(obj) (Teardown(obj))
 
 void Teardown()
 {
-  TAKINA_TEARDOWN(&help);
   TAKINA_TEARDOWN(&usage);
   TAKINA_TEARDOWN(&description);
-  TAKINA_TEARDOWN(&long_param_map);
-  TAKINA_TEARDOWN(&short_param_map);
-  TAKINA_TEARDOWN(&section_opt_map);
-  TAKINA_TEARDOWN(&sections);
+  // The lazy values set by config file may be used after Teardown()
+  auto registry = LoadRegistry();
+  for (auto id : registry->lazy_options) {
+    if (BitsetTest(config_file_options, id)) {
+      LazyValueAccess::Own((LazyValueBase *)(registry->params[id].param));
+    }
+  }
+  registry.reset();
+
+  TAKINA_TEARDOWN(&config_file_options);
+  TAKINA_TEARDOWN(&config_file_states);
+  for (auto const &file : config_files) {
+    ::munmap(file.addr, file.len);
+  }
+  TAKINA_TEARDOWN(&config_files);
+
+  {
+    auto                       &cache = GetParseCache();
+    std::lock_guard<std::mutex> guard(cache.mutex);
+    TAKINA_TEARDOWN(&cache.entries);
+    TAKINA_TEARDOWN(&cache.hash_entry_map);
+  }
+
+  // The registry is released when the last Parse() using it returns
+  auto                        &state = GetRegistryState();
+  std::lock_guard<std::mutex> guard(state.mutex);
+  state.draft = std::make_shared<Registry>();
+  PublishDraft(state);
 }
 
-static inline void GenHelp()
+static inline void GenHelp(Registry const &registry, std::string *help_msg)
 {
+  auto const &sections = registry.sections;
+  auto       &help     = *help_msg;
 
   help.reserve(usage.size() + description.size());
   help = usage;
   help += description;
 
+  if (!registry.positionals.empty()) {
+    int name_align_len = 0;
+    for (auto const &pos : registry.positionals) {
+      name_align_len = TAKINA_MAX(name_align_len, (int)pos.name.size());
+    }
+
+    char buf[65535];
+    help += "Positional arguments: \n";
+    for (auto const &pos : registry.positionals) {
+      ::snprintf(buf, sizeof buf, "%-*s  %s\n", name_align_len, pos.name.c_str(), pos.desc.c_str());
+      help += buf;
+    }
+    help += "\n";
+  }
+
   int short_opt_align_len      = 0;
   int long_opt_param_align_len = 0;
 
   if (!sections.empty()) {
-    for (auto const &section_opt : section_opt_map) {
-      auto &options = section_opt.second;
+    for (auto const &section : sections) {
+      auto &options = section.opts;
       for (auto const &option : options) {
         long_opt_param_align_len = TAKINA_MAX(
             long_opt_param_align_len,
@@ -400,11 +1320,10 @@ static inline void GenHelp()
 
   help += "Options: \n";
   for (auto const &section : sections) {
-    help += *section;
-    if (!section->empty()) help += ":\n";
+    help += section.name;
+    if (!section.name.empty()) help += ":\n";
 
-    auto const &opts = section_opt_map[*section];
-    GenOptions(opts, long_opt_param_align_len, short_opt_align_len);
+    GenOptions(section.opts, long_opt_param_align_len, short_opt_align_len, &help);
     help += "\n";
   }
   // Remove the last newline
@@ -414,7 +1333,8 @@ static inline void GenHelp()
 void GenOptions(
     std::vector<OptionDescption> const &opts,
     int                                 long_opt_param_align_len,
-    int                                 short_opt_align_len
+    int                                 short_opt_align_len,
+    std::string                        *help
 )
 {
   char        buf[65535];
@@ -447,48 +1367,68 @@ void GenOptions(
         lopt_param.c_str(),
         opt.desc.c_str()
     );
-    help += buf;
+    *help += buf;
   }
 }
 
-inline void AddOption_impl(OptDesc &&desc, OptionParameter opt_param)
+inline OptionHandle AddOption_impl(OptDesc &&desc, OptionParameter opt_param)
 {
-  if (desc.lopt.empty()) return;
+  return ModifyRegistry([&](Registry &registry) {
+    return RegisterOption(&registry, std::move(desc), std::move(opt_param));
+  });
+}
 
-  auto res = long_param_map.insert({(desc.lopt), opt_param});
+static inline OptionHandle
+RegisterOption(Registry *registry, OptDesc &&desc, OptionParameter opt_param)
+{
+  OptionHandle handle;
+  if (desc.lopt.empty()) return handle;
+
+  auto &params = registry->params;
+  opt_param.id = params.size();
+  auto res     = registry->long_param_map.insert({(desc.lopt), opt_param.id});
   if (!res.second) {
     ::fprintf(stderr, "The long option: %s does exists\n", desc.lopt.c_str());
-    return;
+    return handle;
   }
+  opt_param.name = desc.lopt;
+  params.push_back(std::move(opt_param));
+  handle.id = res.first->second;
+  if (params.back().type == OT_LAZY) registry->lazy_options.push_back(handle.id);
 
   if (!desc.sopt.empty()) {
-    if (!short_param_map.insert({(desc.sopt), &res.first->second}).second) {
+    if (!registry->short_param_map.insert({(desc.sopt), handle.id}).second) {
       ::fprintf(stderr, "The short option: %s does exists\n", desc.sopt.c_str());
-      return;
+      return handle;
     }
   }
 
-  assert(!sections.empty());
-  section_opt_map[*sections.back()].push_back(std::move(desc));
+  assert(!registry->sections.empty());
+  params.back().section = registry->sections.back().name;
+  registry->sections.back().opts.push_back(std::move(desc));
+  return handle;
 }
 
+/* Used for int options and int64_t positional arguments */
+template <typename T>
 static inline bool StrInt(
-    int               *param,
+    T                 *param,
     char const        *arg,
     std::string const &cur_option,
-    std::string       *errmsg
+    std::string       *errmsg,
+    char const        *prefix
 )
 {
   char      *end = nullptr;
-  const auto res = ::strtol(arg, &end, 10);
+  const auto res = ::strtoll(arg, &end, 10);
   if (res == 0 && end == arg) {
-    *errmsg = "Option: ";
+    *errmsg = prefix;
     *errmsg += cur_option;
     *errmsg += '\n';
     *errmsg += "syntax error: this is not a valid integer argument";
     return false;
   }
-  *param = res;
+  *param = (T)res;
   return true;
 }
 
@@ -496,13 +1436,14 @@ static inline bool StrDouble(
     double            *param,
     char const        *arg,
     std::string const &cur_option,
-    std::string       *errmsg
+    std::string       *errmsg,
+    char const        *prefix
 )
 {
   char      *end = nullptr;
   const auto res = ::strtod(arg, &end);
   if (res == 0 && end == arg) {
-    *errmsg = "Option: ";
+    *errmsg = prefix;
     *errmsg += cur_option;
     *errmsg += '\n';
     *errmsg += "Syntax error: this is not a valid float-pointing number argument";
@@ -513,11 +1454,11 @@ static inline bool StrDouble(
 }
 
 static inline bool SetParameter(
-    OptionParameter   *param,
-    char const        *arg,
-    unsigned int       cur_arg_num,
-    std::string const &cur_option,
-    std::string       *errmsg
+    OptionParameter const *param,
+    char const            *arg,
+    unsigned int           cur_arg_num,
+    std::string const     &cur_option,
+    std::string           *errmsg
 )
 {
   switch (param->type) {
@@ -583,16 +1524,304 @@ static inline bool SetParameter(
         return false;
       }
     } break;
+    case OT_LAZY: {
+      LazyValueAccess::Append((LazyValueBase *)(param->param), arg, cur_option);
+    } break;
+  }
+
+  return true;
+}
+
+static inline void RecordAssignment(
+    ParseCacheEntry       *entry,
+    OptionParameter const *param,
+    unsigned int           cur_arg_num,
+    unsigned int           argv_idx
+)
+{
+  Assignment assignment;
+  assignment.id       = param ? param->id : INVALID_OPTION_ID;
+  assignment.arg_num  = cur_arg_num;
+  assignment.argv_idx   = argv_idx;
+  assignment.positional = false;
+  assignment.value.i    = 0;
+
+  // Read back the converted value from the variable
+  if (param) {
+    switch (param->type) {
+      case OT_INT:
+        assignment.value.i = *(int *)(param->param);
+        break;
+      case OT_MINT:
+        assignment.value.i = ((std::vector<int> *)(param->param))->back();
+        break;
+      case OT_FINT:
+        assignment.value.i = ((int *)(param->param))[cur_arg_num - 1];
+        break;
+      case OT_DOUBLE:
+        assignment.value.d = *(double *)(param->param);
+        break;
+      case OT_MDOUBLE:
+        assignment.value.d = ((std::vector<double> *)(param->param))->back();
+        break;
+      case OT_FDOUBLE:
+        assignment.value.d = ((double *)(param->param))[cur_arg_num - 1];
+        break;
+      default:
+        break;
+    }
+  }
+
+  entry->assignments.push_back(assignment);
+}
+
+static inline bool ReplayAssignments(
+    Registry const            &registry,
+    ParseCacheEntry const     &entry,
+    char                     **argv_begin,
+    std::vector<char const *> *non_opt_args,
+    bool                       replace,
+    std::string               *errmsg
+)
+{
+  auto const &states = ParseResultAccess::States(entry.result);
+  for (size_t id = 0; id < states.size(); ++id) {
+    if (states[id].occurrences != 0 && (replace || BitsetTest(config_file_options, id))) {
+      ClearParameter(&registry.params[id]);
+    }
   }
 
+  for (auto const &assignment : entry.assignments) {
+    char const *arg = argv_begin[assignment.argv_idx];
+    if (assignment.id == INVALID_OPTION_ID) {
+      non_opt_args->push_back(arg);
+      continue;
+    }
+
+    if (assignment.positional) {
+      ReplayPositional(registry.positionals[assignment.id], arg, assignment);
+      continue;
+    }
+
+    auto const &param = registry.params[assignment.id];
+    switch (param.type) {
+      case OT_VOID:
+        *(bool *)(param.param) = true;
+        break;
+      case OT_INT:
+        *(int *)(param.param) = assignment.value.i;
+        break;
+      case OT_MINT:
+        ((std::vector<int> *)(param.param))->emplace_back(assignment.value.i);
+        break;
+      case OT_FINT:
+        ((int *)(param.param))[assignment.arg_num - 1] = assignment.value.i;
+        break;
+      case OT_DOUBLE:
+        *(double *)(param.param) = assignment.value.d;
+        break;
+      case OT_MDOUBLE:
+        ((std::vector<double> *)(param.param))->emplace_back(assignment.value.d);
+        break;
+      case OT_FDOUBLE:
+        ((double *)(param.param))[assignment.arg_num - 1] = assignment.value.d;
+        break;
+      default:
+        // No conversion, or the user-defined callback must be called again
+        if (!SetParameter(&param, arg, assignment.arg_num, param.name, errmsg)) return false;
+    }
+  }
   return true;
 }
 
+template <typename T>
+static inline void RecordPositional(
+    ParseCacheEntry *entry,
+    unsigned int     pos_idx,
+    unsigned int     argv_idx,
+    T const         &value
+)
+{
+  Assignment assignment;
+  assignment.id         = pos_idx;
+  assignment.arg_num    = 0;
+  assignment.argv_idx   = argv_idx;
+  assignment.positional = true;
+  assignment.value.i    = 0;
+  ::memcpy(&assignment.value, &value, sizeof(T));
+  entry->assignments.push_back(assignment);
+}
+
+template <typename T, typename F>
+static inline bool ConvertVariadic(
+    Positional const *pos,
+    char            **argv_begin,
+    char            **argv_end,
+    std::string      *errmsg,
+    F                 convert
+)
+{
+  auto vec = (std::vector<T> *)(pos->param);
+  vec->reserve(vec->size() + (argv_end - argv_begin));
+  for (auto cur = argv_begin; cur != argv_end; ++cur) {
+    T value;
+    if (!convert(&value, *cur, pos->name, errmsg, POSITIONAL_ERRMSG)) return false;
+    vec->push_back(value);
+  }
+  return true;
+}
+
+static inline bool FillPositional(
+    Positional const *pos,
+    unsigned int      pos_idx,
+    char           ***argv_cur,
+    char            **argv_end,
+    char            **argv_first,
+    ParseCacheEntry  *entry,
+    std::string      *errmsg
+)
+{
+  char **argv_begin = *argv_cur;
+
+  if (!pos->variadic) {
+    char const        *arg      = *argv_begin;
+    const unsigned int argv_idx = unsigned(argv_begin - argv_first);
+    switch (pos->type) {
+      case PT_STR:
+        *(std::string *)(pos->param) = arg;
+        if (entry) RecordPositional(entry, pos_idx, argv_idx, 0);
+        break;
+      case PT_INT64:
+        if (!StrInt((int64_t *)(pos->param), arg, pos->name, errmsg, POSITIONAL_ERRMSG)) {
+          return false;
+        }
+        if (entry) RecordPositional(entry, pos_idx, argv_idx, *(int64_t *)(pos->param));
+        break;
+      case PT_DOUBLE:
+        if (!StrDouble((double *)(pos->param), arg, pos->name, errmsg, POSITIONAL_ERRMSG)) {
+          return false;
+        }
+        if (entry) RecordPositional(entry, pos_idx, argv_idx, *(double *)(pos->param));
+        break;
+    }
+    return true;
+  }
+
+  // Find the run of non-option arguments, then convert them in bulk
+  // into the vector reserved once.
+  char **run_end = argv_begin + 1;
+  while (run_end != argv_end && !((*run_end)[0] == '-' && (*run_end)[1] != '\0')) {
+    ++run_end;
+  }
+
+  switch (pos->type) {
+    case PT_STR: {
+      auto vec = (std::vector<std::string> *)(pos->param);
+      vec->reserve(vec->size() + (run_end - argv_begin));
+      for (auto cur = argv_begin; cur != run_end; ++cur) {
+        vec->emplace_back(*cur);
+        if (entry) RecordPositional(entry, pos_idx, unsigned(cur - argv_first), 0);
+      }
+    } break;
+    case PT_INT64: {
+      if (!ConvertVariadic<int64_t>(pos, argv_begin, run_end, errmsg, StrInt<int64_t>)) {
+        return false;
+      }
+      auto const &vec = *(std::vector<int64_t> *)(pos->param);
+      if (entry) {
+        auto value = vec.end() - (run_end - argv_begin);
+        for (auto cur = argv_begin; cur != run_end; ++cur, ++value) {
+          RecordPositional(entry, pos_idx, unsigned(cur - argv_first), *value);
+        }
+      }
+    } break;
+    case PT_DOUBLE: {
+      if (!ConvertVariadic<double>(pos, argv_begin, run_end, errmsg, StrDouble)) return false;
+      auto const &vec = *(std::vector<double> *)(pos->param);
+      if (entry) {
+        auto value = vec.end() - (run_end - argv_begin);
+        for (auto cur = argv_begin; cur != run_end; ++cur, ++value) {
+          RecordPositional(entry, pos_idx, unsigned(cur - argv_first), *value);
+        }
+      }
+    } break;
+  }
+
+  *argv_cur = run_end - 1;
+  return true;
+}
+
+static inline void
+ReplayPositional(Positional const &pos, char const *arg, Assignment const &assignment)
+{
+  switch (pos.type) {
+    case PT_STR:
+      if (pos.variadic) {
+        ((std::vector<std::string> *)(pos.param))->emplace_back(arg);
+      } else {
+        *(std::string *)(pos.param) = arg;
+      }
+      break;
+    case PT_INT64:
+      if (pos.variadic) {
+        ((std::vector<int64_t> *)(pos.param))->push_back(assignment.value.l);
+      } else {
+        *(int64_t *)(pos.param) = assignment.value.l;
+      }
+      break;
+    case PT_DOUBLE:
+      if (pos.variadic) {
+        ((std::vector<double> *)(pos.param))->push_back(assignment.value.d);
+      } else {
+        *(double *)(pos.param) = assignment.value.d;
+      }
+      break;
+  }
+}
+
+static inline void ClearPositional(Positional const &pos)
+{
+  assert(pos.variadic);
+  switch (pos.type) {
+    case PT_STR:
+      ((std::vector<std::string> *)(pos.param))->clear();
+      break;
+    case PT_INT64:
+      ((std::vector<int64_t> *)(pos.param))->clear();
+      break;
+    case PT_DOUBLE:
+      ((std::vector<double> *)(pos.param))->clear();
+      break;
+  }
+}
+
+/* Remove the arguments set by config file or the previous line of Shell */
+static inline void ClearParameter(OptionParameter const *param)
+{
+  switch (param->type) {
+    case OT_MSTR:
+      ((std::vector<std::string> *)(param->param))->clear();
+      break;
+    case OT_MINT:
+      ((std::vector<int> *)(param->param))->clear();
+      break;
+    case OT_MDOUBLE:
+      ((std::vector<double> *)(param->param))->clear();
+      break;
+    case OT_LAZY:
+      LazyValueAccess::Clear((LazyValueBase *)(param->param));
+      break;
+    default:
+      // The others are overwritten
+      break;
+  }
+}
+
 static inline bool CheckArgumentIsLess(
-    OptionParameter   *cur_param,
-    std::string const &cur_option,
-    unsigned int       cur_arg_num,
-    std::string       *errmsg
+    OptionParameter const *cur_param,
+    std::string const     &cur_option,
+    unsigned int           cur_arg_num,
+    std::string           *errmsg
 )
 {
   bool condition = false;
@@ -611,6 +1840,10 @@ static inline bool CheckArgumentIsLess(
       case OT_USR:
         condition = (cur_arg_num < cur_param->size);
         break;
+      case OT_LAZY:
+        // The multiple version accepts zero argument
+        condition = cur_param->size != MAX_OPTION_ARGS_NUM && cur_arg_num < cur_param->size;
+        break;
     }
   }
 
@@ -625,11 +1858,28 @@ static inline bool CheckArgumentIsLess(
 }
 
 static inline bool CheckArgumentIsGreater(
-    OptionParameter   *cur_param,
-    std::string const &cur_option,
-    unsigned int       cur_arg_num,
-    std::string       *errmsg
+    OptionParameter const *cur_param,
+    std::string const     &cur_option,
+    unsigned int           cur_arg_num,
+    std::string           *errmsg
 )
+{
+  const unsigned int size = MaxArgumentNum(cur_param);
+
+  if (cur_arg_num > size) {
+    if (!enable_independent_non_opt_arg) {
+      *errmsg = "To unary argument option: ";
+      *errmsg += cur_option;
+      *errmsg += ", the number of arguments more than ";
+      /* Because SSO, no dynamic allocation in most */
+      *errmsg += std::to_string(size);
+    }
+    return true;
+  }
+  return false;
+}
+
+static inline unsigned int MaxArgumentNum(OptionParameter const *cur_param) noexcept
 {
   unsigned int size = 0;
   assert(cur_param);
@@ -643,7 +1893,8 @@ static inline bool CheckArgumentIsGreater(
     case OT_FDOUBLE:
     case OT_FINT:
     case OT_FSTR:
-    case OT_USR: {
+    case OT_USR:
+    case OT_LAZY: {
       size = cur_param->size;
     } break;
 
@@ -653,18 +1904,92 @@ static inline bool CheckArgumentIsGreater(
       size = std::numeric_limits<unsigned int>::max();
     } break;
   }
+  return size;
+}
 
-  if (cur_arg_num > size) {
-    if (!enable_independent_non_opt_arg) {
-      *errmsg = "To unary argument option: ";
-      *errmsg += cur_option;
-      *errmsg += ", the number of arguments more than ";
-      /* Because SSO, no dynamic allocation in most */
-      *errmsg += std::to_string(size);
+static inline bool FindOptionId(Registry const &registry, std::string const &lopt, unsigned int *id)
+{
+  auto iter = registry.long_param_map.find(lopt);
+  if (iter == registry.long_param_map.end()) {
+    ::fprintf(stderr, "The long option: %s does not exists\n", lopt.c_str());
+    return false;
+  }
+  *id = iter->second;
+  return true;
+}
+
+static inline bool CheckConstraints(
+    Registry const    &registry,
+    ParseResult const &result,
+    std::string       *errmsg
+)
+{
+  auto const &params = registry.params;
+  auto const &seen   = ParseResultAccess::Seen(result);
+  auto const &states = ParseResultAccess::States(result);
+
+  // The bitsets of constraints may be shorter than seen
+  // since the options can be added after them
+  for (size_t i = 0; i < registry.required_options.size(); ++i) {
+    const uint64_t missing = registry.required_options[i] & ~seen[i];
+    if (missing) {
+      *errmsg = "Option: ";
+      *errmsg += params[BitsetFirst(i, missing)].name;
+      *errmsg += " is required";
+      return false;
     }
-    return true;
   }
-  return false;
+
+  for (auto const &group : registry.exclusive_groups) {
+    unsigned int first_id  = 0;
+    bool         has_first = false;
+    for (size_t i = 0; i < group.size(); ++i) {
+      uint64_t conflict = group[i] & seen[i];
+      if (!conflict) continue;
+      if (!has_first) {
+        first_id  = BitsetFirst(i, conflict);
+        has_first = true;
+        conflict &= conflict - 1;
+        if (!conflict) continue;
+      }
+      *errmsg = "Option: ";
+      *errmsg += params[first_id].name;
+      *errmsg += " and option: ";
+      *errmsg += params[BitsetFirst(i, conflict)].name;
+      *errmsg += " are mutually exclusive";
+      return false;
+    }
+  }
+
+  for (auto const &dependency : registry.dependencies) {
+    if (!BitsetTest(seen, dependency.id)) continue;
+    for (size_t i = 0; i < dependency.required.size(); ++i) {
+      const uint64_t missing = dependency.required[i] & ~seen[i];
+      if (missing) {
+        *errmsg = "Option: ";
+        *errmsg += params[dependency.id].name;
+        *errmsg += " requires option: ";
+        *errmsg += params[BitsetFirst(i, missing)].name;
+        return false;
+      }
+    }
+  }
+
+  for (auto const &limit : registry.occurrence_limits) {
+    const unsigned int occurrence = states[limit.id].occurrences;
+    if (occurrence < limit.min || occurrence > limit.max) {
+      *errmsg = "Option: ";
+      *errmsg += params[limit.id].name;
+      *errmsg += ", the number of occurrences should be in [";
+      *errmsg += std::to_string(limit.min);
+      *errmsg += ", ";
+      *errmsg += std::to_string(limit.max);
+      *errmsg += "]";
+      return false;
+    }
+  }
+
+  return true;
 }
 
 std::vector<char const *> &GetNonOptionArguments()
@@ -690,8 +2015,441 @@ std::string opt_strings[OT_NUM] = {
     "float numbers",
     "",
     "user",
+    "",
 };
 
 static std::string const &OptType2Str(OptType t) noexcept { return opt_strings[(int)t]; }
 
+template <>
+bool LazyValue<int>::DoConvert(std::string *errmsg)
+{
+  // Not specified in the last Parse()
+  if (args_.empty()) {
+    value_ = 0;
+    return true;
+  }
+  return StrInt(&value_, args_.back(), option_, errmsg);
+}
+
+template <>
+bool LazyValue<double>::DoConvert(std::string *errmsg)
+{
+  if (args_.empty()) {
+    value_ = 0;
+    return true;
+  }
+  return StrDouble(&value_, args_.back(), option_, errmsg);
+}
+
+template <>
+bool LazyValue<std::vector<int>>::DoConvert(std::string *errmsg)
+{
+  value_.resize(args_.size());
+  for (size_t i = 0; i < args_.size(); ++i) {
+    if (!StrInt(&value_[i], args_[i], option_, errmsg)) return false;
+  }
+  return true;
+}
+
+template <>
+bool LazyValue<std::vector<double>>::DoConvert(std::string *errmsg)
+{
+  value_.resize(args_.size());
+  for (size_t i = 0; i < args_.size(); ++i) {
+    if (!StrDouble(&value_[i], args_[i], option_, errmsg)) return false;
+  }
+  return true;
+}
+
+static inline bool WriteAll(int fd, char const *data, size_t len)
+{
+  while (len != 0) {
+    const auto n = ::write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+Shell::Shell(int in_fd, int out_fd)
+  : in_fd_(in_fd)
+  , out_fd_(out_fd)
+{
+}
+
+void Shell::AddCommand(std::string const &name, CommandHandler handler)
+{
+  if (!handlers_.insert({name, std::move(handler)}).second) {
+    ::fprintf(stderr, "The command: %s does exists\n", name.c_str());
+  }
+}
+
+bool Shell::Tokenize(char *line, std::vector<char *> *tokens, std::string *errmsg)
+{
+  /*
+   * The token is written back to the line and terminated by NUL.
+   * Since the escape and quote characters are removed,
+   * the write position never exceeds the read position.
+   */
+  char *r = line;
+  char *w = line;
+  tokens->clear();
+
+  for (;;) {
+    while (*r == ' ' || *r == '\t' || *r == '\r') ++r;
+    if (*r == '\0' || *r == '#') break;
+
+    tokens->push_back(w);
+    for (; *r != '\0' && *r != ' ' && *r != '\t' && *r != '\r'; ++r) {
+      switch (*r) {
+        case '\\':
+          if (r[1] != '\0') ++r;
+          *w++ = *r;
+          break;
+        case '\'': {
+          char const *begin = ++r;
+          while (*r != '\0' && *r != '\'') *w++ = *r++;
+          if (*r == '\0') {
+            *errmsg = "Syntax error: unterminated single quote at column ";
+            *errmsg += std::to_string(begin - line);
+            return false;
+          }
+        } break;
+        case '"': {
+          char const *begin = ++r;
+          for (; *r != '\0' && *r != '"'; ++r) {
+            // Only the quote and backslash can be escaped
+            if (*r == '\\' && (r[1] == '"' || r[1] == '\\')) ++r;
+            *w++ = *r;
+          }
+          if (*r == '\0') {
+            *errmsg = "Syntax error: unterminated double quote at column ";
+            *errmsg += std::to_string(begin - line);
+            return false;
+          }
+        } break;
+        default:
+          *w++ = *r;
+      }
+    }
+
+    // Terminate the token, r may point to the NUL of line
+    const bool end = *r == '\0';
+    *w++           = '\0';
+    if (end) break;
+    ++r;
+  }
+
+  return true;
+}
+
+bool Shell::Execute(char *line, std::string *errmsg)
+{
+  errmsg->clear();
+  if (!Tokenize(line, &tokens_, errmsg)) return false;
+  // Blank line or comment
+  if (tokens_.empty()) return true;
+
+  // The lookup of the handler is not a hot path,
+  // short command name is stored in the SSO buffer.
+  auto iter = handlers_.find(tokens_[0]);
+  if (iter == handlers_.end()) {
+    *errmsg = "Unknown command: ";
+    *errmsg += tokens_[0];
+    return false;
+  }
+
+  bool   has_help = false;
+  char **argv     = tokens_.data();
+  args_.clear();
+  if (!ParseArguments_impl(
+          argv + 1,
+          argv + tokens_.size(),
+          errmsg,
+          &result_,
+          &has_help,
+          &args_,
+          true
+      ))
+  {
+    return false;
+  }
+
+  if (has_help) {
+    GenHelp(*LoadRegistry(), &help_);
+    return WriteAll(out_fd_, help_.data(), help_.size());
+  }
+
+  return iter->second(result_, args_, errmsg);
+}
+
+bool Shell::Run()
+{
+  std::string errmsg;
+  size_t      len = 0; // Length of the unprocessed data
+
+  if (buffer_.size() < 4096) buffer_.resize(4096);
+
+  for (;;) {
+    // Reserve one byte for the NUL of the last line
+    if (len + 1 == buffer_.size()) buffer_.resize(buffer_.size() << 1);
+
+    auto n = ::read(in_fd_, &buffer_[len], buffer_.size() - len - 1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+
+    const bool eof   = n == 0;
+    char      *begin = buffer_.data();
+    char      *end   = begin + len + n;
+    char      *line  = begin;
+
+    for (;;) {
+      auto newline = (char *)::memchr(line, '\n', end - line);
+      if (!newline) {
+        if (!eof || line == end) break;
+        newline = end;
+      }
+      *newline = '\0';
+
+      if (!Execute(line, &errmsg)) {
+        errmsg.insert(0, "Error: ");
+        errmsg += '\n';
+        if (!WriteAll(out_fd_, errmsg.data(), errmsg.size())) return false;
+      }
+      line = newline + 1;
+      if (line > end) line = end;
+    }
+
+    if (eof) return true;
+
+    // Move the incomplete line to the front
+    len = end - line;
+    ::memmove(begin, line, len);
+  }
+}
+
+static inline char *TrimSpace(char *begin, char *end, char **trimmed_end) noexcept
+{
+  while (begin != end && (*begin == ' ' || *begin == '\t' || *begin == '\r')) ++begin;
+  while (end != begin && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) --end;
+  *trimmed_end = end;
+  return begin;
+}
+
+/*
+ * Parse a NUL-terminated line of config file.
+ * The error message doesn't contain the position, the caller adds it.
+ */
+static bool ParseConfigLine(
+    Registry const      &registry,
+    char                *line,
+    std::string         *cur_section,
+    std::vector<char *> *tokens,
+    std::string         *errmsg
+)
+{
+  char *end;
+  char *begin = TrimSpace(line, line + ::strlen(line), &end);
+
+  // Blank line or comment
+  if (begin == end || *begin == '#' || *begin == ';') return true;
+
+  if (*begin == '[') {
+    if (end[-1] != ']') {
+      *errmsg = "Syntax error: section is not terminated by ]";
+      return false;
+    }
+    char *name_end;
+    char *name = TrimSpace(begin + 1, end - 1, &name_end);
+    cur_section->assign(name, name_end);
+    for (auto const &section : registry.sections) {
+      if (section.name == *cur_section) return true;
+    }
+    *errmsg = "Section: ";
+    *errmsg += *cur_section;
+    *errmsg += " is not an valid section";
+    return false;
+  }
+
+  auto equal = (char *)::memchr(begin, '=', end - begin);
+  if (!equal) {
+    *errmsg = "Syntax error: expect key = value";
+    return false;
+  }
+
+  char             *key_end;
+  char             *key_begin = TrimSpace(begin, equal, &key_end);
+  const std::string key(key_begin, key_end);
+
+  auto iter = registry.long_param_map.find(key);
+  if (iter == registry.long_param_map.end()) {
+    *errmsg = "Option: ";
+    *errmsg += key;
+    *errmsg += " is not an valid option";
+    return false;
+  }
+
+  auto const &param = registry.params[iter->second];
+  if (!cur_section->empty() && param.section != *cur_section) {
+    *errmsg = "Option: ";
+    *errmsg += key;
+    *errmsg += " does not belong to section: ";
+    *errmsg += *cur_section;
+    return false;
+  }
+
+  // The value is split as the Shell does
+  *end = '\0';
+  if (!Shell::Tokenize(equal + 1, tokens, errmsg)) return false;
+
+  if (param.type == OT_VOID) {
+    if (tokens->size() > 1 ||
+        (tokens->size() == 1 && ::strcmp((*tokens)[0], "true") && ::strcmp((*tokens)[0], "false")))
+    {
+      *errmsg = "Option: ";
+      *errmsg += key;
+      *errmsg += ", the value should be true or false";
+      return false;
+    }
+    const bool value = tokens->empty() || !::strcmp((*tokens)[0], "true");
+    // The help option binds no variable
+    if (param.param) *(bool *)(param.param) = value;
+    if (config_file_states.size() <= param.id) config_file_states.resize(param.id + 1);
+    // false is same as not specified, e.g. for the exclusive options
+    if (!value) {
+      BitsetReset(&config_file_options, param.id);
+      config_file_states[param.id] = {};
+    }
+    config_file_states[param.id].assigned = true;
+    config_file_states[param.id].flag     = value;
+    if (!value) return true;
+  } else {
+    const auto arg_num = (unsigned int)tokens->size();
+    if (CheckArgumentIsLess(&param, key, arg_num, errmsg)) return false;
+    if (arg_num > MaxArgumentNum(&param)) {
+      *errmsg = "Option: ";
+      *errmsg += key;
+      *errmsg += ", the number of arguments more than ";
+      *errmsg += std::to_string(MaxArgumentNum(&param));
+      return false;
+    }
+    for (unsigned int i = 0; i < arg_num; ++i) {
+      if (!SetParameter(&param, (*tokens)[i], i + 1, key, errmsg)) return false;
+    }
+
+    if (config_file_states.size() <= param.id) config_file_states.resize(param.id + 1);
+    auto &option = config_file_states[param.id];
+    option.assigned = true;
+    option.count += arg_num;
+    for (unsigned int i = 0; i < arg_num; ++i) {
+      option.args.push_back((*tokens)[i]);
+      option.arg_nums.push_back(i + 1);
+    }
+  }
+
+  BitsetSet(&config_file_options, param.id);
+  config_file_states[param.id].occurrences++;
+  return true;
+}
+
+void ApplyConfigFile()
+{
+  auto        registry = LoadRegistry();
+  auto const &params   = registry->params;
+  std::string errmsg;
+
+  for (size_t id = 0; id < config_file_states.size() && id < params.size(); ++id) {
+    auto const &option = config_file_states[id];
+    auto const &param  = params[id];
+    if (!option.assigned || param.removed) continue;
+
+    if (param.type == OT_VOID) {
+      if (param.param) *(bool *)(param.param) = option.flag;
+      continue;
+    }
+    // The arguments have been checked by ParseConfigFile()
+    for (size_t i = 0; i < option.args.size(); ++i) {
+      SetParameter(&param, option.args[i], option.arg_nums[i], param.name, &errmsg);
+    }
+  }
+}
+
+bool ParseConfigFile(char const *path, std::string *errmsg)
+{
+  errmsg->clear();
+
+  const int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    *errmsg = path;
+    *errmsg += ": ";
+    *errmsg += ::strerror(errno);
+    return false;
+  }
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    *errmsg = path;
+    *errmsg += ": ";
+    *errmsg += ::strerror(errno);
+    ::close(fd);
+    return false;
+  }
+
+  ConfigFile file;
+  file.len = st.st_size;
+  if (file.len != 0) {
+    // Private writable mapping, so the lines can be terminated in place
+    file.addr = ::mmap(nullptr, file.len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (file.addr == MAP_FAILED) {
+      *errmsg = path;
+      *errmsg += ": ";
+      *errmsg += ::strerror(errno);
+      ::close(fd);
+      return false;
+    }
+  }
+  ::close(fd);
+
+  if (file.len == 0) return true;
+  config_files.push_back(std::move(file));
+  auto &mapped = config_files.back();
+
+  auto                registry = LoadRegistry();
+  std::string         cur_section;
+  std::vector<char *> tokens;
+  char               *begin   = (char *)mapped.addr;
+  char               *end     = begin + mapped.len;
+  size_t              line_no = 0;
+
+  while (begin != end) {
+    ++line_no;
+    char *line    = begin;
+    auto  newline = (char *)::memchr(begin, '\n', end - begin);
+    if (newline) {
+      *newline = '\0';
+      begin    = newline + 1;
+    } else {
+      mapped.last_line.assign(begin, end);
+      line  = &mapped.last_line[0];
+      begin = end;
+    }
+
+    if (!ParseConfigLine(*registry, line, &cur_section, &tokens, errmsg)) {
+      errmsg->insert(0, ": ");
+      errmsg->insert(0, std::to_string(line_no));
+      errmsg->insert(0, ":");
+      errmsg->insert(0, path);
+      return false;
+    }
+  }
+
+  return true;
+}
+
 } // namespace takina
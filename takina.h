@@ -4,6 +4,10 @@
 #include <string>
 #include <vector>
 #include <functional> // function
+#include <memory>     // shared_ptr, atomic_load(), atomic_store()
+#include <mutex>
+#include <cstdint>    // uint64_t
+#include <unordered_map>
 
 // I don't want to introduce std::max()
 #define TAKINA_MAX(x, y) (((x) < (y)) ? (y) : (x))
@@ -23,6 +27,81 @@ struct OptionDescption {
 
 using OptDesc = OptionDescption;
 
+struct PositionalDescription {
+  std::string name; // shown as <name> or <name...>(variadic)
+  std::string desc;
+};
+
+using PosDesc = PositionalDescription;
+
+struct LazyValueAccess;
+
+/**
+ * The base of lazy option values.
+ * Parse() only checks the number of arguments and records them,
+ * the conversion is deferred to the first access.
+ */
+class LazyValueBase {
+ public:
+  virtual ~LazyValueBase() = default;
+
+  /** The recorded arguments, they point to the argv passed to Parse() */
+  std::vector<char const *> const &Arguments() const noexcept { return args_; }
+
+  bool IsConverted() const noexcept { return converted_; }
+
+  /** Convert the recorded arguments if not converted */
+  bool Convert(std::string *errmsg)
+  {
+    if (converted_) return true;
+    std::string msg;
+    converted_ = DoConvert(errmsg ? errmsg : &msg);
+    return converted_;
+  }
+
+ protected:
+  virtual bool DoConvert(std::string *errmsg) = 0;
+
+  std::vector<char const *> args_;
+  std::string               option_;     // Used for error message
+  std::string               owned_args_; // Copied from the config file by Teardown()
+  bool                      converted_ = false;
+
+  friend struct LazyValueAccess;
+};
+
+/**
+ * Option value converted on demand and cached.
+ * Only int, double, std::vector<int> and std::vector<double> are supported.
+ * The argv must be alive until the value is converted.
+ * Each Parse() replaces the recorded arguments instead of appending to them,
+ * the value is zero(or empty) if the option isn't specified.
+ */
+template <typename T>
+class LazyValue final : public LazyValueBase {
+ public:
+  /** Return nullptr if the arguments are invalid */
+  T const *Get(std::string *errmsg = nullptr)
+  {
+    if (!Convert(errmsg)) return nullptr;
+    return &value_;
+  }
+
+ private:
+  bool DoConvert(std::string *errmsg) override;
+
+  T value_{};
+};
+
+template <>
+bool LazyValue<int>::DoConvert(std::string *errmsg);
+template <>
+bool LazyValue<double>::DoConvert(std::string *errmsg);
+template <>
+bool LazyValue<std::vector<int>>::DoConvert(std::string *errmsg);
+template <>
+bool LazyValue<std::vector<double>>::DoConvert(std::string *errmsg);
+
 /** Add usage of process */
 void AddUsage(std::string const &desc);
 
@@ -32,28 +111,293 @@ void AddDescription(std::string const &desc);
 /** Add section of options(or options group) */
 void AddSection(std::string &&section);
 
+/**
+ * Remove the section and all options in it, e.g. unload a plugin.
+ * The handles of the removed options are not reused.
+ */
+void RemoveSection(std::string const &section);
+
+/**
+ * Call fn which adds or removes options, then publish all the changes at once.
+ * Other threads keep parsing against the previous options until fn returns.
+ * The changes out of UpdateOptions() are published by the next Parse().
+ */
+void UpdateOptions(std::function<void()> const &fn);
+
+/**
+ * Publish the pending changes, then wait until all the Parse() calls
+ * using the previous options return(grace period).
+ * After that, the variables and callbacks of the removed options are not
+ * accessed anymore, e.g. unload a plugin:
+ * ```
+ * RemoveSection("plugin");
+ * Synchronize();
+ * dlclose(handle);
+ * ```
+ * It must not be called in Parse()(e.g. in the callback of option) or UpdateOptions().
+ */
+void Synchronize();
+
+#define INVALID_OPTION_ID ((unsigned int)-1)
+
+/**
+ * Dense id of an option, used to query the ParseResult without hashing the option name.
+ * If the option can't be added(e.g. duplicate), the id is INVALID_OPTION_ID.
+ */
+struct OptionHandle {
+  unsigned int id = INVALID_OPTION_ID;
+
+  bool IsValid() const noexcept { return id != INVALID_OPTION_ID; }
+};
+
 /** Add Options */
-void AddOption(OptDesc &&desc, bool *param);
-void AddOption(OptDesc &&desc, std::string *param);
-void AddOption(OptDesc &&desc, int *param);
-void AddOption(OptDesc &&desc, double *param);
-void AddOption(OptDesc &&desc, std::vector<std::string> *param);
-void AddOption(OptDesc &&desc, std::vector<int> *param);
-void AddOption(OptDesc &&desc, std::vector<double> *param);
-void AddOption(OptDesc &&desc, std::string *param, unsigned int n);
-void AddOption(OptDesc &&desc, int *param, unsigned int n);
-void AddOption(OptDesc &&desc, double *param, unsigned int n);
-void AddOption(OptDesc &&desc, OptionFunction fn, unsigned int n = 1);
+OptionHandle AddOption(OptDesc &&desc, bool *param);
+OptionHandle AddOption(OptDesc &&desc, std::string *param);
+OptionHandle AddOption(OptDesc &&desc, int *param);
+OptionHandle AddOption(OptDesc &&desc, double *param);
+OptionHandle AddOption(OptDesc &&desc, std::vector<std::string> *param);
+OptionHandle AddOption(OptDesc &&desc, std::vector<int> *param);
+OptionHandle AddOption(OptDesc &&desc, std::vector<double> *param);
+OptionHandle AddOption(OptDesc &&desc, std::string *param, unsigned int n);
+OptionHandle AddOption(OptDesc &&desc, int *param, unsigned int n);
+OptionHandle AddOption(OptDesc &&desc, double *param, unsigned int n);
+OptionHandle AddOption(OptDesc &&desc, OptionFunction fn, unsigned int n = 1);
+OptionHandle AddOption(OptDesc &&desc, LazyValue<int> *param);
+OptionHandle AddOption(OptDesc &&desc, LazyValue<double> *param);
+OptionHandle AddOption(OptDesc &&desc, LazyValue<std::vector<int>> *param);
+OptionHandle AddOption(OptDesc &&desc, LazyValue<std::vector<double>> *param);
 #define MAX_OPTION_ARGS_NUM ((unsigned int)-1)
 
+/**
+ * Add positional arguments, which are filled in the order of declaration
+ * by the non-option arguments in the same scan as options.
+ * The vector version is variadic, it must be the last one and accepts
+ * zero or more arguments, which are converted in bulk.
+ * The non-option arguments out of the positional arguments are
+ * handled as before, see EnableIndependentNonOptionArgument().
+ */
+void AddPositional(PosDesc &&desc, std::string *param);
+void AddPositional(PosDesc &&desc, int64_t *param);
+void AddPositional(PosDesc &&desc, double *param);
+void AddPositional(PosDesc &&desc, std::vector<std::string> *param);
+void AddPositional(PosDesc &&desc, std::vector<int64_t> *param);
+void AddPositional(PosDesc &&desc, std::vector<double> *param);
+
+/**
+ * Constraints of options, they are checked at the end of Parse().
+ * The options are specified by long option and must be added before.
+ */
+void AddRequired(std::string const &lopt);
+void AddExclusive(std::vector<std::string> const &lopts);
+/** lopt requires required_lopt if it is specified */
+void AddDependency(std::string const &lopt, std::string const &required_lopt);
+/** The option can be specified [min, max] times */
+void SetOccurrence(std::string const &lopt, unsigned int min, unsigned int max);
+
+struct ParseResultAccess;
+
+/**
+ * Which options are specified in the last Parse() and how.
+ * All queries are just array indexing by the id of handle.
+ * The options set by config file and not overridden by argv are reported
+ * as specified in the file, but their ArgvIndex() is -1.
+ * Reuse the object to avoid allocation in the next Parse().
+ */
+class ParseResult {
+ public:
+  bool IsSet(OptionHandle handle) const noexcept
+  {
+    return handle.id < states_.size() && ((seen_[handle.id >> 6] >> (handle.id & 63)) & 1);
+  }
+
+  /** The number of arguments of all occurrences */
+  unsigned int Count(OptionHandle handle) const noexcept
+  {
+    return handle.id < states_.size() ? states_[handle.id].count : 0;
+  }
+
+  /** The number of times the option is specified */
+  unsigned int Occurrences(OptionHandle handle) const noexcept
+  {
+    return handle.id < states_.size() ? states_[handle.id].occurrences : 0;
+  }
+
+  /**
+   * The index of the last occurrence in [argv_begin, argv_end) passed to Parse(),
+   * -1 if the option isn't specified.
+   * For Parse(argc, argv, ...), the index in argv is the returned value plus 1.
+   */
+  int ArgvIndex(OptionHandle handle) const noexcept
+  {
+    return handle.id < states_.size() ? states_[handle.id].argv_index : -1;
+  }
+
+  /** The number of arguments filled into the positional arguments */
+  unsigned int PositionalCount() const noexcept { return positional_count_; }
+
+ private:
+  struct OptionState {
+    unsigned int occurrences = 0;
+    unsigned int count       = 0;
+    int          argv_index  = -1;
+  };
+
+  std::vector<uint64_t>    seen_; // bitset indexed by option id
+  std::vector<OptionState> states_;
+  unsigned int             positional_count_ = 0;
+
+  friend struct ParseResultAccess;
+};
+
 /** parse the command line arguments */
-bool Parse(char **argv_begin, char **argv_end, std::string *errmsg);
+bool Parse(char **argv_begin, char **argv_end, std::string *errmsg, ParseResult *result);
+
+inline bool Parse(char **argv_begin, char **argv_end, std::string *errmsg)
+{
+  ParseResult result;
+  return Parse(argv_begin, argv_end, errmsg, &result);
+}
 
 inline bool Parse(int argc, char **argv, std::string *errmsg)
 {
   return Parse(argv + 1, argv + argc, errmsg);
 }
 
+inline bool Parse(int argc, char **argv, std::string *errmsg, ParseResult *result)
+{
+  return Parse(argv + 1, argv + argc, errmsg, result);
+}
+
+/**
+ * Like Parse(), but don't print the help message and exit the process
+ * when --help is specified, set *has_help instead.
+ * It is used by the long-running process, e.g. ConfigSnapshot::Reconfigure().
+ * The non-option arguments are pushed to non_opt_args if it isn't nullptr,
+ * otherwise to GetNonOptionArguments().
+ */
+bool ParseArguments(
+    char                     **argv_begin,
+    char                     **argv_end,
+    std::string               *errmsg,
+    ParseResult               *result,
+    bool                      *has_help,
+    std::vector<char const *> *non_opt_args = nullptr
+);
+
+/**
+ * Admin console reading commands from a file descriptor.
+ *
+ * Each line is "command [options]", the options are parsed by Parse()
+ * against the registered options, then the handler of the command is called.
+ * The line is tokenized in place, the tokens point to the read buffer,
+ * so no memory is allocated for each token.
+ *
+ * The bound variables keep the values of the previous lines unless
+ * specified in this line, use the ParseResult to check which are specified.
+ * The multi-value options, lazy values and the variadic positional argument
+ * are replaced by each line instead of appended.
+ * The lazy values and the non-option arguments point to the read buffer,
+ * so they are only valid in the handler.
+ *
+ * Syntax of line:
+ * - Tokens are separated by whitespaces
+ * - '...' quotes the characters literally
+ * - "..." quotes the characters, \" and \\ are escaped
+ * - \ escapes the next character out of quotes
+ * - # starts a comment out of quotes
+ */
+class Shell {
+ public:
+  /**
+   * Return false and set the errmsg if the command is failed.
+   * args are the non-option arguments of the line, which are accepted
+   * only if EnableIndependentNonOptionArgument(true).
+   */
+  typedef std::function<
+      bool(ParseResult const &result, std::vector<char const *> const &args, std::string *errmsg)>
+      CommandHandler;
+
+  explicit Shell(int in_fd, int out_fd = 1);
+
+  void AddCommand(std::string const &name, CommandHandler handler);
+
+  /**
+   * Execute the commands until end of file.
+   * The error of command is written to out_fd and doesn't stop the loop.
+   * Return false if read or write is failed.
+   */
+  bool Run();
+
+  /** Execute a NUL-terminated line, which is modified by the tokenizer */
+  bool Execute(char *line, std::string *errmsg);
+
+  /** Split the NUL-terminated line in place */
+  static bool Tokenize(char *line, std::vector<char *> *tokens, std::string *errmsg);
+
+ private:
+  int                                             in_fd_;
+  int                                             out_fd_;
+  std::unordered_map<std::string, CommandHandler> handlers_;
+
+  // Reused in each line
+  std::vector<char>         buffer_;
+  std::vector<char *>       tokens_;
+  std::vector<char const *> args_; // non-option arguments
+  ParseResult               result_;
+  std::string               help_;
+};
+
+/**
+ * Load options from a config file, which should be called before Parse(),
+ * then the arguments in argv override the values in the file.
+ *
+ * Format:
+ * ```
+ * # comment or ; comment
+ * long-option = value1 value2 ...
+ * [section]
+ * long-option-in-section = value
+ * ```
+ * The value is split as the Shell does, and converted as argv.
+ * The value of option without argument is true(or empty) or false.
+ * The file is memory-mapped and kept until Teardown(), which copies the
+ * arguments of the lazy values pointing to it, so they can still be converted.
+ */
+bool ParseConfigFile(char const *path, std::string *errmsg);
+
+/**
+ * Write the values loaded by ParseConfigFile() to the bound variables again,
+ * which should be called after the variables are reset to the defaults,
+ * e.g. ConfigSnapshot::Reconfigure().
+ * The values are not kept after Teardown().
+ */
+void ApplyConfigFile();
+
+/** Convert all the lazy values, report the first invalid argument */
+bool ValidateAll(std::string *errmsg);
+
+/**
+ * Cache the results of the last capacity distinct command lines(LRU).
+ * When the same command line is parsed again, Parse() replays the cached
+ * bindings instead of looking up options and converting the arguments.
+ * The user-defined callbacks are still called.
+ * 0 disables the cache, which is the default.
+ *
+ * Trade-off: the cache is guarded by a single mutex, so once it is enabled,
+ * each Parse() takes the mutex for the lookup(and the LRU update) and the
+ * insertion. The registry is still read without locks, but the concurrent
+ * parsers contend on the mutex. Keep it disabled if many threads parse
+ * distinct command lines concurrently.
+ */
+void EnableParseCache(size_t capacity);
+
+struct ParseCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+};
+
+ParseCacheStats GetParseCacheStats() noexcept;
+
 /** Free the resources used for parsing options */
 void Teardown();
 
@@ -63,6 +407,89 @@ void EnableIndependentNonOptionArgument(bool opt) noexcept;
 
 std::vector<char const *> &GetNonOptionArguments();
 
+/**
+ * Publish the config parsed from a command line as an immutable snapshot.
+ *
+ * Bind the options to the fields of Staging() instead of the variables
+ * read by workers. Reconfigure() resets the staging config to the defaults,
+ * applies the config file(see ApplyConfigFile()), parses into it and
+ * publishes a copy atomically if parsing is successful.
+ * The --help is rejected instead of exiting the process.
+ * Readers call Load() to get the current snapshot, which is never modified,
+ * so they don't see a half-updated std::string or std::vector.
+ *
+ * Reconfigure() calls are serialized, but they must not run concurrently
+ * with other Parse() calls since the bindings are shared.
+ */
+template <typename Config>
+class ConfigSnapshot {
+ public:
+  explicit ConfigSnapshot(Config const &defaults = Config{})
+    : defaults_(defaults)
+    , staging_(defaults)
+    , current_(std::make_shared<Config const>(defaults))
+  {
+  }
+
+  ConfigSnapshot(ConfigSnapshot const &)            = delete;
+  ConfigSnapshot &operator=(ConfigSnapshot const &) = delete;
+
+  /** The object the options should be bound to */
+  Config *Staging() noexcept { return &staging_; }
+
+  /** Parse the command line and publish the result if success */
+  bool Reconfigure(char **argv_begin, char **argv_end, std::string *errmsg)
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    staging_ = defaults_;
+    // The values of config file are wiped by the reset
+    ApplyConfigFile();
+    // The non-option arguments point to the previous command line
+    non_opt_args_.clear();
+
+    bool has_help = false;
+    if (!ParseArguments(argv_begin, argv_end, errmsg, &result_, &has_help, &non_opt_args_)) {
+      return false;
+    }
+    if (has_help) {
+      // Don't exit the process, the current snapshot is kept
+      *errmsg = "Option: help can't be used to reconfigure";
+      return false;
+    }
+    std::atomic_store(&current_, std::make_shared<Config const>(staging_));
+    return true;
+  }
+
+  bool Reconfigure(int argc, char **argv, std::string *errmsg)
+  {
+    return Reconfigure(argv + 1, argv + argc, errmsg);
+  }
+
+  /**
+   * The non-option arguments of the last Reconfigure(), they point to its argv.
+   * The GetNonOptionArguments() of the startup argv is not touched.
+   */
+  std::vector<char const *> const &NonOptionArguments() const noexcept { return non_opt_args_; }
+
+  /**
+   * Get the current snapshot.
+   * Readers never wait for the parsing, but the read is not lock-free:
+   * the atomic access of shared_ptr isn't lock-free in the common standard
+   * libraries(e.g. libstdc++ takes a mutex from a pool), so each Load()
+   * takes a short internal lock held only for copying the pointer.
+   * Hold the returned snapshot instead of calling Load() in a hot loop.
+   */
+  std::shared_ptr<Config const> Load() const noexcept { return std::atomic_load(&current_); }
+
+ private:
+  Config const                  defaults_;
+  Config                        staging_;
+  std::shared_ptr<Config const> current_;
+  ParseResult                   result_; // Reused by each Reconfigure()
+  std::vector<char const *>     non_opt_args_;
+  std::mutex                    mutex_; // serialize the writers
+};
+
 } // namespace takina
 
 #endif // _TAKINA_TAKINA_H_